@@ -1,14 +1,68 @@
-#define _XOPEN_SOURCE 700
+#define _GNU_SOURCE
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <sys/ioctl.h>
 #include <unistd.h>
-#include <locale.h>
-#include <wchar.h>
-#include <ctype.h>
 #include <errno.h> // For errno and perror
-#include <wctype.h>
+#include <getopt.h>
+#include <poll.h>
+#include <signal.h>
+#include <sys/syscall.h>
+#if defined(__linux__) && defined(__has_include)
+#if __has_include(<linux/io_uring.h>)
+#include <linux/io_uring.h>
+#define CNTR_IO_URING // Asynchronous I/O through io_uring, see AsyncIo
+#endif
+#endif
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <sys/uio.h>
+#include <stdint.h>
+#include <pthread.h>
+#include <time.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#include <immintrin.h>
+#elif defined(__ARM_NEON)
+#include <arm_neon.h>
+#endif
+
+#include "cntr_width.h" // UTF-8 decoder and width tables, see tools/gen_width.c
+#include "libcntr.h"    // Library interface, implemented at the end of this file
+
+#define STREAM_CHUNK_SIZE (64 * 1024)  // Bytes read per chunk in streaming mode
+#define DEFAULT_TAB_SIZE 8             // Columns between tab stops unless set with --tabsize
+#define MMAP_THRESHOLD (64 * 1024)     // Regular files at least this large are memory-mapped
+#define STDIN_BUFFER_SIZE (1024 * 1024) // Smallest mapping standard input is read into
+#define OUTPUT_BUFFER_SIZE (64 * 1024) // Output is written in batches of this size
+#define DIRECT_WRITE_SIZE (8 * 1024)   // Lines at least this long are written without copying
+#define ARENA_BLOCK_SIZE (64 * 1024)   // Size of the blocks small arena allocations come from
+#define ARENA_LARGE_SIZE (16 * 1024)   // Allocations at least this large get their own block
+#define PARALLEL_PARSE_THRESHOLD (16 * 1024 * 1024) // Inputs at least this large are parsed on all CPUs
+#define PARALLEL_CHUNK_MIN (4 * 1024 * 1024)        // Smallest input share per parser thread
+#define MAX_PARSE_THREADS 64
+#define PARALLEL_RENDER_LINES (256 * 1024) // Documents with at least this many lines are rendered on all CPUs
+#define RENDER_BLOCK_LINES (16 * 1024)     // Lines formatted per block by a render thread
+#define MAX_RENDER_THREADS 64
+#define ASYNC_OUTPUT_LINES 4096            // Documents with at least this many lines are written in the background
+#define MAX_FILE_THREADS 64                // Threads loading files when several are given
+#define STREAM_WINDOW_LINES 4096         // Lines held back to align a block in streaming mode
+#define STREAM_WINDOW_SIZE (1024 * 1024) // Bytes held back to align a block in streaming mode
+#define STREAM_LONG_LINE (1024 * 1024)   // Unfinished lines this long are checked for pass-through
+#define STREAM_PAUSE_MS 50               // Silence after which a block is shown early on a terminal
+#define FOLLOW_HISTORY_LINES 1024        // Lines of a stream kept to redraw the screen with --follow
+#define CLEAR_SCREEN "\033[H\033[2J"      // Moves the cursor home and clears the terminal
+#define SERVE_MAX_REQUEST (64 * 1024 * 1024) // Largest request accepted by --serve
+#define SERVE_IDLE_SESSIONS 16               // Warm sessions kept for later --serve connections
+#define SERVE_MAX_CONNECTIONS 64             // Connections --serve handles at once; more wait to be accepted
+#define LINE_CACHE_ENTRIES 4096   // Lines whose widths --line-cache remembers
+#define LINE_CACHE_MAX_LENGTH 256 // Longer lines are always measured
+#define MAX_AREA_WIDTH 65536      // Widest area accepted by --width and --columns
 
 /**
  * Gets the current width of the terminal
@@ -26,635 +80,5053 @@ int getTerminalWidth()
 }
 
 /**
- * Calculates the display width of a UTF-8 string
+ * Gets the current height of the terminal
  *
- * @param str UTF-8 encoded string
- * @return Number of visual characters (not bytes)
+ * @return Number of rows of the terminal or a default value on error
  */
-int getDisplayWidth(const char *str)
+int getTerminalHeight()
 {
-    int width = 0;
-    mbstate_t state;
-    memset(&state, 0, sizeof(state));
-
-    const char *ptr = str;
-    size_t len = strlen(str); // Get total string length
-    while (len > 0)
-    { // Use len instead of *ptr != '\0' for safety with mbrtowc
-        wchar_t wc;
-        int consumed = mbrtowc(&wc, ptr, len, &state);
-
-        if (consumed == (size_t)-1 || consumed == (size_t)-2)
-        {
-            // Invalid sequence, treat as 1 char wide
-            // fprintf(stderr, "Warning: Invalid UTF-8 sequence found.\n");
-            width++; // Count it as 1 for safety
-            ptr++;
-            len--;
-            memset(&state, 0, sizeof(state)); // Reset state
-            continue;
-        }
-        else if (consumed == 0)
-        {
-            // Null character reached
-            break;
-        }
-
-        int char_width = wcwidth(wc);
-        if (char_width < 0)
-            char_width = 1; // Treat non-printable/control characters as width 1
-        width += char_width;
-        ptr += consumed;
-        len -= consumed;
+    struct winsize w;
+    if (ioctl(STDOUT_FILENO, TIOCGWINSZ, &w) == -1 || w.ws_row == 0)
+    {
+        return 24; // Default height if ioctl fails
     }
-
-    return width;
+    return w.ws_row;
 }
 
+static volatile sig_atomic_t cachedTerminalWidth = 0; // Width as of the last SIGWINCH, 0 before the first
+static volatile sig_atomic_t terminalResizeCount = 0; // Number of SIGWINCH signals received
+
 /**
- * Structure for a text paragraph
+ * SIGWINCH handler: stores the new width, so renderers pick it up with a
+ * single load instead of an ioctl per line
  */
-typedef struct
+static void handleTerminalResize(int signum)
 {
-    char **lines;  // Array of lines in the paragraph
-    int lineCount; // Number of lines
-    int capacity;  // Capacity of the lines array
-} Paragraph;
+    (void)signum;
+    int savedErrno = errno;
+    cachedTerminalWidth = getTerminalWidth();
+    terminalResizeCount = terminalResizeCount + 1;
+    errno = savedErrno;
+}
 
 /**
- * Initializes a new paragraph
+ * Keeps cachedTerminalWidth up to date from now on if the output goes to a
+ * terminal. Interrupted reads and writes are restarted.
  */
-Paragraph *createParagraph()
+void watchTerminalResize()
 {
-    Paragraph *para = (Paragraph *)malloc(sizeof(Paragraph));
-    if (!para)
-    {
-        perror("Memory allocation error for Paragraph");
-        return NULL;
-    }
-
-    para->capacity = 8; // Initial capacity
-    para->lineCount = 0;
-    para->lines = (char **)malloc(para->capacity * sizeof(char *));
+    if (!isatty(STDOUT_FILENO))
+        return;
+    struct sigaction action;
+    memset(&action, 0, sizeof(action));
+    action.sa_handler = handleTerminalResize;
+    action.sa_flags = SA_RESTART;
+    sigemptyset(&action.sa_mask);
+    sigaction(SIGWINCH, &action, NULL);
+}
 
-    if (!para->lines)
+/**
+ * Waits until a file descriptor has input or the terminal is resized,
+ * without missing a resize that happens just before the wait starts.
+ *
+ * @param fd File descriptor to wait for, -1 to wait for a resize only.
+ * @param seenResizes Value of terminalResizeCount the caller has handled.
+ * @return 1 if the terminal was resized, 0 if input is ready or on error.
+ */
+int waitForInputOrResize(int fd, sig_atomic_t seenResizes)
+{
+    sigset_t blocked, original;
+    sigemptyset(&blocked);
+    sigaddset(&blocked, SIGWINCH);
+    pthread_sigmask(SIG_BLOCK, &blocked, &original);
+    int resized;
+    while (!(resized = terminalResizeCount != seenResizes))
     {
-        perror("Memory allocation error for Paragraph lines");
-        free(para);
-        return NULL;
+        // The signal is only let through while ppoll waits
+        struct pollfd pfd = {fd, POLLIN, 0};
+        int ready = ppoll(&pfd, 1, NULL, &original);
+        if (ready > 0 || (ready < 0 && errno != EINTR))
+            break;
     }
-
-    return para;
+    pthread_sigmask(SIG_SETMASK, &original, NULL);
+    return resized;
 }
 
 /**
- * Adds a line to a paragraph
+ * Counters and stage timings reported by --stats. Nothing is counted or
+ * timed unless enabled is set, so without --stats each point costs one
+ * predictable branch. Threads update the counters atomically.
  */
-void addLineToParagraph(Paragraph *para, const char *line)
+typedef struct
 {
-    if (!para)
-        return;
-    if (para->lineCount >= para->capacity)
-    {
-        int newCapacity = para->capacity * 2;
-        char **newLines = (char **)realloc(para->lines, newCapacity * sizeof(char *));
-        if (!newLines)
-        {
-            perror("Reallocation error for Paragraph lines");
-            // Line cannot be added
-            return;
-        }
-        para->lines = newLines;
-        para->capacity = newCapacity;
-    }
+    int enabled;                        // Set by --stats
+    int streamed;                       // Input was centered while it was read
+    unsigned long long bytesIn;         // Bytes of input
+    unsigned long long bytesOut;        // Bytes written to the output
+    unsigned long long lines;           // Non-empty lines of the input
+    unsigned long long paragraphs;      // Paragraphs of the input
+    unsigned long long documentGrowths; // Arrays grown by addLineToParagraph and addParagraphToDocument
+    unsigned long long arenaMallocs;    // Arena blocks allocated with malloc
+    unsigned long long arenaReallocs;   // Large arena allocations resized with realloc
+    unsigned long long writeCalls;      // writev, vmsplice and io_uring write operations
+    unsigned long long cacheHits;       // Lines whose width came from the line cache
+    unsigned long long cacheMisses;     // Lines the line cache had to measure
+    unsigned long long readNanos;       // Reading the input, or waiting for it while streaming
+    unsigned long long parseNanos;      // Splitting into lines and measuring their widths
+    unsigned long long outputNanos;     // Rendering and writing (and parsing while streaming)
+    unsigned long long writeNanos;      // Rendering thread blocked on writes and on output back-pressure
+} Stats;
 
-    para->lines[para->lineCount] = strdup(line);
-    if (!para->lines[para->lineCount])
-    {
-        perror("strdup error for Paragraph line");
-        return;
-    }
-    para->lineCount++;
+static Stats stats;
+
+/**
+ * Adds to a counter of stats if --stats is enabled
+ */
+static inline void addStat(unsigned long long *counter, unsigned long long amount)
+{
+    if (stats.enabled)
+        __atomic_fetch_add(counter, amount, __ATOMIC_RELAXED);
 }
 
 /**
- * Frees the memory of a paragraph
+ * Reads the monotonic clock for a stage timing of stats
+ *
+ * @return Nanoseconds, or 0 if --stats is not enabled.
  */
-void freeParagraph(Paragraph *para)
+static inline unsigned long long statsClock()
 {
-    if (!para)
-        return;
-    for (int i = 0; i < para->lineCount; i++)
-    {
-        free(para->lines[i]);
-    }
-    free(para->lines);
-    free(para);
+    if (!stats.enabled)
+        return 0;
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (unsigned long long)ts.tv_sec * 1000000000ULL + (unsigned long long)ts.tv_nsec;
 }
 
 /**
- * Structure for the entire document
+ * Adds the time since a statsClock reading to a stage timing of stats
  */
-typedef struct
+static inline void addStatTime(unsigned long long *counter, unsigned long long start)
 {
-    Paragraph **paragraphs; // Array of paragraphs
-    int paragraphCount;     // Number of paragraphs
-    int capacity;           // Capacity of the paragraphs array
-} Document;
+    if (stats.enabled)
+        addStat(counter, statsClock() - start);
+}
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define CNTR_X86_KERNELS // SSE2, AVX2 and AVX-512 kernels are built whatever -march says
+#endif
+
+/*
+ * Kernels counting the leading bytes of a string that need no decoding:
+ * printable 7-bit ASCII (0x20-0x7F). Each of them is one character of
+ * display width 1, so runs of them can be measured in bulk. Control
+ * characters (null, newline, tab, ESC, ...) and non-ASCII bytes end the
+ * run. Every kernel gets its own copy of measureText (see WidthKernel), so
+ * that they are inlined into its loop.
+ */
 
 /**
- * Initializes a new document
+ * Finishes a plain run byte by byte from where a vector loop stopped
  */
-Document *createDocument()
+static inline size_t finishPlainRun(const unsigned char *s, size_t i, size_t length)
 {
-    Document *doc = (Document *)malloc(sizeof(Document));
-    if (!doc)
+    while (i < length && s[i] >= 0x20 && s[i] < 0x80)
     {
-        perror("Memory allocation error for Document");
-        return NULL;
+        i++;
     }
+    return i;
+}
 
-    doc->capacity = 8; // Initial capacity
-    doc->paragraphCount = 0;
-    doc->paragraphs = (Paragraph **)malloc(doc->capacity * sizeof(Paragraph *));
+// Works a word at a time; runs on every CPU
+static inline size_t plainRunScalar(const unsigned char *s, size_t length)
+{
+    size_t i = 0;
+    for (; i + 8 <= length; i += 8)
+    {
+        uint64_t w;
+        memcpy(&w, s + i, sizeof(w));
+        // High bit set in a byte >= 0x80, or (at least) in the first byte < 0x20
+        uint64_t stop = (w | (w - 0x2020202020202020ULL)) & 0x8080808080808080ULL;
+        if (stop)
+            break; // The scalar loop finds the exact position
+    }
+    return finishPlainRun(s, i, length);
+}
 
-    if (!doc->paragraphs)
+#if defined(CNTR_X86_KERNELS)
+// A signed compare catches both the control characters and bytes >= 0x80
+__attribute__((target("sse2"))) static inline size_t plainRunSse2(const unsigned char *s, size_t length)
+{
+    size_t i = 0;
+    const __m128i space = _mm_set1_epi8(0x20);
+    for (; i + 16 <= length; i += 16)
     {
-        perror("Memory allocation error for Document paragraphs");
-        free(doc);
-        return NULL;
+        __m128i v = _mm_loadu_si128((const __m128i *)(s + i));
+        unsigned int mask = (unsigned int)_mm_movemask_epi8(_mm_cmpgt_epi8(space, v));
+        if (mask)
+            return i + __builtin_ctz(mask);
     }
+    return i + plainRunScalar(s + i, length - i);
+}
 
-    return doc;
+__attribute__((target("avx2"))) static inline size_t plainRunAvx2(const unsigned char *s, size_t length)
+{
+    size_t i = 0;
+    const __m256i space = _mm256_set1_epi8(0x20);
+    for (; i + 32 <= length; i += 32)
+    {
+        __m256i v = _mm256_loadu_si256((const __m256i *)(s + i));
+        unsigned int mask = (unsigned int)_mm256_movemask_epi8(_mm256_cmpgt_epi8(space, v));
+        if (mask)
+            return i + __builtin_ctz(mask);
+    }
+    return i + plainRunSse2(s + i, length - i); // Short lines end in the tail, so halve the step
 }
 
-/**
- * Adds a paragraph to a document
- */
-void addParagraphToDocument(Document *doc, Paragraph *para)
+__attribute__((target("avx512f,avx512bw"))) static inline size_t plainRunAvx512(const unsigned char *s, size_t length)
 {
-    if (!doc || !para)
-        return;
-    if (doc->paragraphCount >= doc->capacity)
+    size_t i = 0;
+    const __m512i space = _mm512_set1_epi8(0x20);
+    for (; i + 64 <= length; i += 64)
     {
-        int newCapacity = doc->capacity * 2;
-        Paragraph **newParagraphs = (Paragraph **)realloc(doc->paragraphs, newCapacity * sizeof(Paragraph *));
-        if (!newParagraphs)
-        {
-            perror("Reallocation error for Document paragraphs");
-            // Paragraph cannot be added
-            return;
-        }
-        doc->paragraphs = newParagraphs;
-        doc->capacity = newCapacity;
+        __m512i v = _mm512_loadu_si512((const void *)(s + i));
+        unsigned long long mask = (unsigned long long)_mm512_cmplt_epi8_mask(v, space);
+        if (mask)
+            return i + __builtin_ctzll(mask);
     }
+    if (i == length)
+        return i;
+    // Tail: a masked load does not touch the bytes past the end
+    __mmask64 valid = _cvtu64_mask64(~0ULL >> (64 - (length - i)));
+    __m512i v = _mm512_maskz_loadu_epi8(valid, s + i);
+    unsigned long long mask = (unsigned long long)_mm512_mask_cmplt_epi8_mask(valid, v, space);
+    return mask ? i + __builtin_ctzll(mask) : length;
+}
 
-    doc->paragraphs[doc->paragraphCount] = para;
-    doc->paragraphCount++;
+static int cpuHasSse2()
+{
+    __builtin_cpu_init();
+    return __builtin_cpu_supports("sse2");
 }
 
-/**
- * Frees the memory of a document
- */
-void freeDocument(Document *doc)
+static int cpuHasAvx2()
 {
-    if (!doc)
-        return;
-    for (int i = 0; i < doc->paragraphCount; i++)
+    __builtin_cpu_init();
+    return __builtin_cpu_supports("avx2");
+}
+
+static int cpuHasAvx512()
+{
+    __builtin_cpu_init();
+    return __builtin_cpu_supports("avx512f") && __builtin_cpu_supports("avx512bw");
+}
+#endif
+
+#if defined(__ARM_NEON)
+// NEON is part of every AArch64 CPU, so this kernel needs no check
+static inline size_t plainRunNeon(const unsigned char *s, size_t length)
+{
+    size_t i = 0;
+    for (; i + 16 <= length; i += 16)
     {
-        freeParagraph(doc->paragraphs[i]);
+        uint8x16_t v = vld1q_u8(s + i);
+        if (vmaxvq_u8(v) >= 0x80 || vminvq_u8(v) < 0x20)
+            break; // The scalar loop finds the exact position
     }
-    free(doc->paragraphs);
-    free(doc);
+    return i + plainRunScalar(s + i, length - i);
 }
+#endif
 
 /**
- * Splits a string at word boundaries to stay within the given maximum width.
- * Considers the actual display width of UTF-8 characters.
- * (This function is not currently used directly, as parseDocument works line by line)
+ * Looks up the display width of a Unicode code point in the generated
+ * two-level table. Code points beyond U+10FFFF (which the decoder accepts in
+ * their historic 5- and 6-byte forms) are not printable and count as 1.
  *
- * @param text The text to split
- * @param maxWidth The maximum width of a line
- * @return A newly allocated Paragraph with the split lines
+ * @param cp The code point
+ * @return 0 for combining and zero-width characters, 2 for wide characters, 1 otherwise
  */
-Paragraph *wrapTextToWidth(const char *text, int maxWidth)
+static inline int getCodepointWidth(uint32_t cp)
 {
-    Paragraph *para = createParagraph();
-    if (!para)
-        return NULL;
+    if (cp >= 0x110000)
+        return 1;
+    uint8_t packed = widthStage2[widthStage1[cp >> 8]][(cp & 0xFF) >> 2];
+    return (packed >> ((cp & 3) * 2)) & 3;
+}
 
-    // Temporary buffer for the current line
-    // Size: Length of the entire paragraph + 1 should be sufficient
-    size_t textLen = strlen(text);
-    char *currentLine = (char *)malloc(textLen + 1);
-    if (!currentLine)
-    {
-        perror("Memory allocation failed for currentLine in wrapTextToWidth");
-        freeParagraph(para);
-        return NULL;
-    }
-    currentLine[0] = '\0';
-    // Word buffer, also generously sized
-    char *word = (char *)malloc(textLen + 1);
-    if (!word)
+/**
+ * Decodes one UTF-8 character with the table-driven decoder.
+ *
+ * @param str Start of the character
+ * @param length Bytes available
+ * @param cp Receives the code point
+ * @return Number of bytes of the character, or 0 if the sequence is invalid or truncated
+ */
+static inline size_t decodeUtf8(const unsigned char *str, size_t length, uint32_t *cp)
+{
+    uint32_t state = UTF8_ACCEPT;
+    uint32_t codepoint = 0;
+    size_t i = 0;
+    do
     {
-        perror("Memory allocation failed for word in wrapTextToWidth");
-        free(currentLine);
-        freeParagraph(para);
-        return NULL;
-    }
+        unsigned char byte = str[i];
+        uint8_t cls = utf8ByteClass[byte];
+        codepoint = state == UTF8_ACCEPT ? (byte & utf8LeadMask[cls]) : (codepoint << 6) | (byte & 0x3F);
+        state = utf8Transition[state][cls];
+        i++;
+    } while (state > UTF8_REJECT && i < length);
 
-    int currentLineWidth = 0;
-    const char *ptr = text;
-    mbstate_t word_state; // For getDisplayWidth inside the loop
-
-    while (*ptr)
-    {
-        // Skip leading whitespace
-        while (*ptr && iswspace(btowc(*ptr)))
-        { // Safer with iswspace for Unicode
-            ptr++;
-        }
+    if (state != UTF8_ACCEPT)
+        return 0;
+    *cp = codepoint;
+    return i;
+}
 
-        if (!*ptr)
-            break; // End of text reached after whitespace
+/**
+ * Finds the end of a terminal escape sequence (ECMA-48), which takes up no
+ * space on the screen: CSI sequences such as SGR colors (ESC [ ... final),
+ * string sequences such as OSC titles and hyperlinks (ESC ] ... BEL or ESC \),
+ * and the short ESC forms (ESC intermediates final). A sequence never
+ * extends past a newline or null byte; if it is cut off there, the part up
+ * to it counts as the sequence.
+ *
+ * @param str Start of the sequence, pointing to ESC
+ * @param length Bytes available
+ * @return Number of bytes of the sequence, or 0 if the ESC starts none
+ */
+static size_t skipEscapeSequence(const unsigned char *str, size_t length)
+{
+    if (length < 2)
+        return 0;
+    unsigned char kind = str[1];
+    size_t i = 2;
 
-        // Extract the next word (sequence without whitespace)
-        int i = 0;
-        while (*ptr && !iswspace(btowc(*ptr)))
+    if (kind == '[')
+    {
+        // CSI: parameter and intermediate bytes, then one final byte
+        while (i < length && str[i] >= 0x20 && str[i] <= 0x3F)
         {
-            // Copy character by character into the word buffer
-            // Ensure the buffer does not overflow (should not happen with textLen+1)
-            if (i < textLen)
-            {
-                word[i++] = *ptr;
-            }
-            ptr++;
+            i++;
         }
-        word[i] = '\0'; // Terminate the word
-
-        memset(&word_state, 0, sizeof(word_state)); // Reset state for getDisplayWidth
-        int wordWidth = getDisplayWidth(word);      // Width of the extracted word
-
-        // Check if the word (plus potentially a space) fits on the current line
-        if (currentLineWidth == 0 || (currentLineWidth + 1 + wordWidth <= maxWidth))
-        {
-            // Add a space if the line is not empty
-            if (currentLineWidth > 0)
-            {
-                // Ensure there is space for the space and the word
-                if (strlen(currentLine) + 1 < textLen)
-                {
-                    strcat(currentLine, " ");
-                    currentLineWidth += 1; // Width of the space
-                }
-            }
+        if (i < length && str[i] >= 0x40 && str[i] <= 0x7E)
+            i++;
+        return i;
+    }
 
-            // Add the word to the current line
-            // Ensure there is space for the word
-            if (strlen(currentLine) + strlen(word) < textLen)
-            {
-                strcat(currentLine, word);
-                currentLineWidth += wordWidth;
-            }
-        }
-        else
+    if (kind == ']' || kind == 'P' || kind == 'X' || kind == '^' || kind == '_')
+    {
+        // OSC, DCS, SOS, PM, APC: a string ended by BEL or ST (ESC \)
+        while (i < length && str[i] != '\n' && str[i] != '\0')
         {
-            // Word doesn't fit anymore: Finalize the current line and add it to the paragraph
-            addLineToParagraph(para, currentLine);
-
-            // The current word becomes the start of the new line
-            // Ensure the word fits in the buffer (it should)
-            if (strlen(word) < textLen + 1)
-            {
-                strcpy(currentLine, word);
-                currentLineWidth = wordWidth;
-            }
-            else
-            {
-                // Should not happen, but clear line for safety
-                currentLine[0] = '\0';
-                currentLineWidth = 0;
-            }
+            if (str[i] == 0x07)
+                return i + 1;
+            if (str[i] == 0x1B && i + 1 < length && str[i + 1] == '\\')
+                return i + 2;
+            i++;
         }
-    } // End while(*ptr)
+        return i;
+    }
 
-    // Add the last line if it has content
-    if (currentLineWidth > 0)
+    // Intermediate bytes followed by a final byte, e.g. ESC ( B or ESC 7
+    i = 1;
+    while (i < length && str[i] >= 0x20 && str[i] <= 0x2F)
     {
-        addLineToParagraph(para, currentLine);
+        i++;
     }
-
-    free(word);
-    free(currentLine);
-
-    return para;
+    if (i < length && str[i] >= 0x30 && str[i] <= 0x7E)
+        return i + 1;
+    return i > 1 ? i : 0;
 }
 
 /**
- * Parses a string into a document structure by recognizing paragraphs
- * (separated by double newlines) and preserving existing line breaks within them.
+ * Measures text up to its end, a null byte, or (if requested) a newline.
+ * Plain ASCII runs are counted in bulk; everything else goes through the
+ * built-in decoder and width table, so the result does not depend on the
+ * locale. Terminal escape sequences have no width; since the bulk scan
+ * stops at ESC, text without escapes never enters their state machine.
+ * A tab advances to the next multiple of tabSize, counted from the start
+ * of the text.
  *
- * @param text The text to parse
- * @return A newly allocated Document structure or NULL on error.
+ * @param plainRunLength Kernel counting the plain run at the start of a string
+ * @param str UTF-8 encoded text (does not need to be null-terminated)
+ * @param length Length of the text in bytes
+ * @param stopAtNewline Stop at the first '\n' instead of counting it as width 1
+ * @param tabSize Columns between tab stops
+ * @param width Receives the display width of the measured part, at most INT_MAX
+ * @return Number of bytes measured
  */
-Document *parseDocument(const char *text)
+static inline __attribute__((always_inline)) size_t measureTextWith(size_t (*plainRunLength)(const unsigned char *,
+                                                                                                  size_t),
+                                                                     const char *str, size_t length,
+                                                                     int stopAtNewline, int tabSize, int *width)
 {
-    Document *doc = createDocument();
-    if (!doc)
-        return NULL;
-
-    const char *textPtr = text; // Pointer to the current position in the text
-
-    while (*textPtr)
+    size_t total = 0; // Counted wider than int, so gigabyte lines saturate instead of wrapping
+    const char *ptr = str;
+    size_t len = length;
+    while (len > 0)
     {
-        // Skip leading empty lines between paragraphs
-        while (*textPtr == '\n')
+        // Non-ASCII text such as CJK has a run of length 0 before every character
+        unsigned char first = (unsigned char)*ptr;
+        size_t plain = first >= 0x20 && first < 0x80 ? plainRunLength((const unsigned char *)ptr, len) : 0;
+        total += plain;
+        ptr += plain;
+        len -= plain;
+        if (len == 0 || *ptr == '\0')
+            break; // End of text or null character reached
+
+        unsigned char byte = (unsigned char)*ptr;
+        if (byte == '\n' && stopAtNewline)
+            break;
+        if (byte == '\t')
         {
-            textPtr++;
+            total += tabSize - total % tabSize; // Advance to the next tab stop
+            ptr++;
+            len--;
+            continue;
         }
-        if (!*textPtr)
-            break; // End of text
-
-        // Find the start of the next paragraph
-        const char *paraStart = textPtr;
-
-        // Find the end of the current paragraph (double newline or end of string)
-        const char *paraEnd = strstr(paraStart, "\n\n");
-        const char *nextParaStart = NULL;
-
-        if (paraEnd == NULL)
+        if (byte == 0x1B)
         {
-            // No \n\n found, paragraph goes to the end of the string
-            paraEnd = paraStart + strlen(paraStart);
-            nextParaStart = paraEnd; // At the end of the text
+            size_t escapeLength = skipEscapeSequence((const unsigned char *)ptr, len);
+            if (escapeLength == 0)
+            {
+                escapeLength = 1;
+                total++; // Lone ESC: control character, width 1
+            }
+            ptr += escapeLength;
+            len -= escapeLength;
+            continue;
         }
-        else
+        if (byte < 0x80)
         {
-            // \n\n found, marks the end of the paragraph
-            nextParaStart = paraEnd + 2; // Skip the two \n
+            total++; // Other control character, width 1
+            ptr++;
+            len--;
+            continue;
         }
 
-        // Create a new paragraph for the document
-        Paragraph *para = createParagraph();
-        if (!para)
+        uint32_t cp;
+        size_t consumed = decodeUtf8((const unsigned char *)ptr, len, &cp);
+        if (consumed == 0)
         {
-            freeDocument(doc); // Cleanup
-            return NULL;       // Error during paragraph creation
+            // Invalid sequence, treat the byte as 1 char wide
+            total++;
+            ptr++;
+            len--;
+            continue;
         }
 
-        // Process the current paragraph line by line
-        const char *lineStart = paraStart;
-        while (lineStart < paraEnd && *lineStart)
-        {
-            // Find the end of the current line (\n or end of paragraph)
-            const char *lineEnd = lineStart;
-            while (lineEnd < paraEnd && *lineEnd != '\n')
-            {
-                lineEnd++;
-            }
+        total += getCodepointWidth(cp);
+        ptr += consumed;
+        len -= consumed;
+    }
 
-            // Extract the line
-            int lineLength = lineEnd - lineStart;
-            char *line = (char *)malloc(lineLength + 1);
-            if (!line)
-            {
-                perror("Memory allocation failed for line in parseDocument");
-                freeParagraph(para);
-                freeDocument(doc);
-                return NULL;
-            }
-            strncpy(line, lineStart, lineLength);
-            line[lineLength] = '\0';
-
-            // Add the extracted line to the paragraph
-            // NOTE: The current design adds lines directly.
-            // If word wrapping *within* paragraphs based on terminal width is desired,
-            // `wrapTextToWidth` (or similar logic) would need to be called here.
-            // Currently, the input's structure (including line breaks) is preserved.
-            addLineToParagraph(para, line);
-            free(line); // strdup was used in addLineToParagraph
-
-            // Go to the start of the next line
-            lineStart = lineEnd;
-            if (lineStart < paraEnd && *lineStart == '\n')
-            {
-                lineStart++; // Skip the \n
-            }
-            // End of inner loop (line processing)
-        } // End while (lineStart < paraEnd)
+    *width = total > INT_MAX ? INT_MAX : (int)total;
+    return ptr - str;
+}
 
-        // Add the filled paragraph to the document
-        addParagraphToDocument(doc, para);
+static size_t measureTextScalar(const char *str, size_t length, int stopAtNewline, int tabSize, int *width)
+{
+    return measureTextWith(plainRunScalar, str, length, stopAtNewline, tabSize, width);
+}
 
-        // Go to the start of the next paragraph
-        textPtr = nextParaStart;
+#if defined(CNTR_X86_KERNELS)
+__attribute__((target("sse2"))) static size_t measureTextSse2(const char *str, size_t length, int stopAtNewline,
+                                                              int tabSize, int *width)
+{
+    return measureTextWith(plainRunSse2, str, length, stopAtNewline, tabSize, width);
+}
 
-    } // End while (*textPtr) - main loop over paragraphs
+__attribute__((target("avx2"))) static size_t measureTextAvx2(const char *str, size_t length, int stopAtNewline,
+                                                              int tabSize, int *width)
+{
+    return measureTextWith(plainRunAvx2, str, length, stopAtNewline, tabSize, width);
+}
 
-    return doc;
+__attribute__((target("avx512f,avx512bw"))) static size_t measureTextAvx512(const char *str, size_t length,
+                                                                            int stopAtNewline, int tabSize, int *width)
+{
+    return measureTextWith(plainRunAvx512, str, length, stopAtNewline, tabSize, width);
 }
+#endif
 
-/**
- * Prints a document centered on the terminal.
- *
- * @param doc The document to print.
- */
-void printCenteredDocument(Document *doc)
+#if defined(__ARM_NEON)
+static size_t measureTextNeon(const char *str, size_t length, int stopAtNewline, int tabSize, int *width)
 {
-    if (!doc)
-        return;
-    const int terminalWidth = getTerminalWidth();
+    return measureTextWith(plainRunNeon, str, length, stopAtNewline, tabSize, width);
+}
+#endif
 
-    for (int i = 0; i < doc->paragraphCount; i++)
-    {
-        Paragraph *para = doc->paragraphs[i];
-        if (!para)
-            continue;
+static int cpuRunsAll()
+{
+    return 1;
+}
 
-        for (int j = 0; j < para->lineCount; j++)
-        {
-            const char *line = para->lines[j];
-            if (!line)
-                continue;
+typedef size_t (*MeasureTextFunction)(const char *str, size_t length, int stopAtNewline, int tabSize, int *width);
+
+/**
+ * A build of measureText around one plain run kernel
+ */
+typedef struct
+{
+    const char *name;            // Name used by CNTR_KERNEL and --stats
+    MeasureTextFunction measure; // measureText with the kernel inlined
+    int (*supported)();          // Whether this CPU can run the kernel
+} WidthKernel;
 
-            int displayWidth = getDisplayWidth(line);
+// Fastest first; the last one runs everywhere
+static const WidthKernel widthKernels[] = {
+#if defined(CNTR_X86_KERNELS)
+    {"avx512", measureTextAvx512, cpuHasAvx512},
+    {"avx2", measureTextAvx2, cpuHasAvx2},
+    {"sse2", measureTextSse2, cpuHasSse2},
+#endif
+#if defined(__ARM_NEON)
+    {"neon", measureTextNeon, cpuRunsAll},
+#endif
+    {"scalar", measureTextScalar, cpuRunsAll},
+};
 
-            // Calculate indentation for centering
-            int padding = (terminalWidth - displayWidth) / 2;
-            if (padding < 0)
-                padding = 0; // Prevent negative padding if line is wider than terminal
+#define WIDTH_KERNEL_COUNT (sizeof(widthKernels) / sizeof(widthKernels[0]))
 
-            // Print spaces for centering
-            for (int k = 0; k < padding; k++)
-            {
-                putchar(' ');
-            }
+static size_t resolveMeasureText(const char *str, size_t length, int stopAtNewline, int tabSize, int *width);
 
-            // Print the (already formatted) line
-            printf("%s\n", line);
-        }
+static const WidthKernel *widthKernel;                       // Kernel in use, NULL until chosen
+static MeasureTextFunction measureTextKernel = resolveMeasureText; // Its measureText
 
-        // Print blank line between paragraphs, except after the last one
-        if (i < doc->paragraphCount - 1)
+/**
+ * Chooses the kernel the width computation and the line scan use.
+ *
+ * @param name Name of a kernel, or NULL for the fastest this CPU supports.
+ * @return 0 on success, -1 if there is no such kernel or the CPU cannot run it.
+ */
+int useWidthKernel(const char *name)
+{
+    for (size_t i = 0; i < WIDTH_KERNEL_COUNT; i++)
+    {
+        const WidthKernel *kernel = &widthKernels[i];
+        if ((!name || strcmp(name, kernel->name) == 0) && kernel->supported())
         {
-            printf("\n");
+            __atomic_store_n(&widthKernel, kernel, __ATOMIC_RELAXED);
+            __atomic_store_n(&measureTextKernel, kernel->measure, __ATOMIC_RELAXED);
+            return 0;
         }
     }
+    return -1;
 }
 
 /**
- * Reads the content of a file into a dynamically allocated string.
- *
- * @param filename Path to the file to be read.
- * @return Dynamically allocated string with the file content, or NULL on error.
+ * Picks the kernel on the first call: the one named by the environment
+ * variable CNTR_KERNEL if the CPU runs it, otherwise the fastest. Threads
+ * racing here all store the same choice.
  */
-char *readFileToString(const char *filename)
+static size_t resolveMeasureText(const char *str, size_t length, int stopAtNewline, int tabSize, int *width)
 {
-    FILE *file = fopen(filename, "r");
-    if (file == NULL)
-    {
-        perror("Error opening file");
-        return NULL;
-    }
+    const char *forced = getenv("CNTR_KERNEL");
+    if (!forced || useWidthKernel(forced) < 0)
+        useWidthKernel(NULL);
+    return __atomic_load_n(&measureTextKernel, __ATOMIC_RELAXED)(str, length, stopAtNewline, tabSize, width);
+}
 
-    fseek(file, 0, SEEK_END);
-    long fileSize = ftell(file);
-    if (fileSize < 0)
+/**
+ * Names the kernel in use, choosing it if none was yet
+ */
+const char *widthKernelName()
+{
+    int width;
+    if (!__atomic_load_n(&widthKernel, __ATOMIC_RELAXED))
+        resolveMeasureText("", 0, 0, DEFAULT_TAB_SIZE, &width);
+    return __atomic_load_n(&widthKernel, __ATOMIC_RELAXED)->name;
+}
+
+/**
+ * Measures text with the fastest kernel the CPU supports (AVX-512, AVX2,
+ * SSE2, NEON or a word at a time), chosen once at run time, so one binary
+ * suits every host. See measureTextWith.
+ */
+static inline size_t measureText(const char *str, size_t length, int stopAtNewline, int tabSize, int *width)
+{
+    return __atomic_load_n(&measureTextKernel, __ATOMIC_RELAXED)(str, length, stopAtNewline, tabSize, width);
+}
+
+/**
+ * Calculates the display width of a UTF-8 string
+ *
+ * @param str UTF-8 encoded string (does not need to be null-terminated)
+ * @param length Length of the string in bytes
+ * @param tabSize Columns between tab stops
+ * @return Number of visual characters (not bytes)
+ */
+int getDisplayWidth(const char *str, size_t length, int tabSize)
+{
+    int width;
+    measureText(str, length, 0, tabSize, &width);
+    return width;
+}
+
+/**
+ * Finds the end of a line and measures its display width in the same pass.
+ *
+ * @param str Start of the line
+ * @param end End of the text
+ * @param tabSize Columns between tab stops
+ * @param width Receives the display width of the line
+ * @return Pointer to the newline or null byte that ends the line, or end
+ */
+const char *scanLine(const char *str, const char *end, int tabSize, int *width)
+{
+    return str + measureText(str, end - str, 1, tabSize, width);
+}
+
+/**
+ * Entry of the line cache
+ */
+typedef struct
+{
+    uint64_t hash;      // Hash of the line's bytes
+    uint32_t next;      // Index + 1 of the next entry in the same bucket, 0 at the end
+    uint16_t length;    // Length of the line in bytes
+    uint8_t used;       // The entry holds a line
+    uint8_t referenced; // Hit since the clock hand last passed; spares the entry once
+    int width;          // Display width of the line
+} LineCacheEntry;
+
+#define LINE_CACHE_BUCKETS (2 * LINE_CACHE_ENTRIES)
+
+/**
+ * Bounded map from the bytes of short lines to their display widths, for
+ * input that repeats lines (separators, headers, log boilerplate). When it is
+ * full, the CLOCK algorithm evicts an entry that was not hit since the hand
+ * last passed it, so memory stays fixed however many distinct lines come.
+ */
+typedef struct
+{
+    LineCacheEntry *entries; // LINE_CACHE_ENTRIES entries
+    char *keys;              // LINE_CACHE_MAX_LENGTH bytes of text per entry
+    uint32_t *buckets;       // Index + 1 of the first entry of each hash bucket, 0 if empty
+    size_t hand;             // Entry the clock hand points at
+} LineCache;
+
+/**
+ * Creates an empty line cache
+ *
+ * @return The cache, or NULL on allocation failure.
+ */
+LineCache *createLineCache()
+{
+    LineCache *cache = (LineCache *)calloc(1, sizeof(LineCache));
+    if (cache)
+    {
+        cache->entries = (LineCacheEntry *)calloc(LINE_CACHE_ENTRIES, sizeof(LineCacheEntry));
+        cache->keys = (char *)malloc((size_t)LINE_CACHE_ENTRIES * LINE_CACHE_MAX_LENGTH);
+        cache->buckets = (uint32_t *)calloc(LINE_CACHE_BUCKETS, sizeof(uint32_t));
+    }
+    if (!cache || !cache->entries || !cache->keys || !cache->buckets)
+    {
+        perror("Memory allocation error for line cache");
+        if (cache)
+        {
+            free(cache->entries);
+            free(cache->keys);
+            free(cache->buckets);
+            free(cache);
+        }
+        return NULL;
+    }
+    return cache;
+}
+
+void freeLineCache(LineCache *cache)
+{
+    if (!cache)
+        return;
+    free(cache->entries);
+    free(cache->keys);
+    free(cache->buckets);
+    free(cache);
+}
+
+/**
+ * Hashes a line a word at a time
+ */
+static inline uint64_t hashLine(const char *str, size_t length)
+{
+    uint64_t hash = 0x9E3779B97F4A7C15ULL ^ length;
+    for (; length >= 8; str += 8, length -= 8)
+    {
+        uint64_t word;
+        memcpy(&word, str, sizeof(word));
+        hash = (hash ^ word) * 0xFF51AFD7ED558CCDULL;
+        hash ^= hash >> 32;
+    }
+    if (length > 0)
+    {
+        uint64_t word = 0;
+        memcpy(&word, str, length);
+        hash = (hash ^ word) * 0xC4CEB9FE1A85EC53ULL;
+        hash ^= hash >> 29;
+    }
+    return hash;
+}
+
+/**
+ * Stores the width of a line, evicting the first entry the clock hand
+ * finds unreferenced
+ */
+static void insertLineCache(LineCache *cache, uint64_t hash, const char *line, size_t length, int width)
+{
+    while (cache->entries[cache->hand].used && cache->entries[cache->hand].referenced)
+    {
+        cache->entries[cache->hand].referenced = 0;
+        cache->hand = (cache->hand + 1) % LINE_CACHE_ENTRIES;
+    }
+    size_t index = cache->hand;
+    cache->hand = (cache->hand + 1) % LINE_CACHE_ENTRIES;
+    LineCacheEntry *entry = &cache->entries[index];
+
+    if (entry->used)
+    {
+        // Unlink the evicted line from its bucket
+        uint32_t *link = &cache->buckets[entry->hash & (LINE_CACHE_BUCKETS - 1)];
+        while (*link != index + 1)
+        {
+            link = &cache->entries[*link - 1].next;
+        }
+        *link = entry->next;
+    }
+
+    uint32_t *bucket = &cache->buckets[hash & (LINE_CACHE_BUCKETS - 1)];
+    entry->hash = hash;
+    entry->next = *bucket;
+    entry->length = (uint16_t)length;
+    entry->used = 1;
+    entry->referenced = 0;
+    entry->width = width;
+    memcpy(cache->keys + index * LINE_CACHE_MAX_LENGTH, line, length);
+    *bucket = (uint32_t)(index + 1);
+}
+
+/**
+ * Like scanLine, but takes the width of a short line from the cache if the
+ * same bytes were measured before. Only lines ended by a newline are
+ * cached; a cached line never contains a null byte, so a line that differs
+ * in one is measured (and ends there) as usual.
+ *
+ * @param cache The line cache, or NULL to always measure.
+ */
+const char *scanLineCached(LineCache *cache, const char *str, const char *end, int tabSize, int *width)
+{
+    if (!cache)
+        return scanLine(str, end, tabSize, width);
+
+    const char *newline = (const char *)memchr(str, '\n', end - str);
+    size_t length = newline ? (size_t)(newline - str) : 0;
+    if (length == 0 || length > LINE_CACHE_MAX_LENGTH)
+        return scanLine(str, end, tabSize, width);
+
+    uint64_t hash = hashLine(str, length);
+    for (uint32_t i = cache->buckets[hash & (LINE_CACHE_BUCKETS - 1)]; i != 0; i = cache->entries[i - 1].next)
+    {
+        LineCacheEntry *entry = &cache->entries[i - 1];
+        if (entry->hash == hash && entry->length == length &&
+            memcmp(cache->keys + (size_t)(i - 1) * LINE_CACHE_MAX_LENGTH, str, length) == 0)
+        {
+            entry->referenced = 1;
+            addStat(&stats.cacheHits, 1);
+            *width = entry->width;
+            return newline;
+        }
+    }
+
+    const char *lineEnd = scanLine(str, end, tabSize, width);
+    addStat(&stats.cacheMisses, 1);
+    if (lineEnd == newline)
+        insertLineCache(cache, hash, str, length, *width);
+    return lineEnd;
+}
+
+/**
+ * Block of an arena, followed by its data
+ */
+typedef struct ArenaBlock
+{
+    struct ArenaBlock *next; // Next (older) block
+    size_t capacity;         // Usable bytes after the header
+    size_t used;             // Bytes handed out
+} ArenaBlock;
+
+/**
+ * Bump allocator: memory is handed out from large blocks and released all
+ * at once with freeArena. Allocations of at least ARENA_LARGE_SIZE bytes get
+ * a block of their own, so growing them can realloc the block in place
+ * (which avoids copying for big arrays) instead of leaving the old copy behind.
+ */
+typedef struct
+{
+    ArenaBlock *head; // Block small allocations are taken from, or NULL
+} Arena;
+
+#define ARENA_ALIGN 16
+#define ARENA_HEADER_SIZE ((sizeof(ArenaBlock) + ARENA_ALIGN - 1) & ~(size_t)(ARENA_ALIGN - 1))
+#define ARENA_ALIGN_SIZE(size) (((size) + ARENA_ALIGN - 1) & ~(size_t)(ARENA_ALIGN - 1))
+
+/**
+ * Returns the first byte after the header of an arena block
+ */
+static inline char *arenaBlockData(ArenaBlock *block)
+{
+    return (char *)block + ARENA_HEADER_SIZE;
+}
+
+/**
+ * Allocates a new arena block with room for at least the given number of bytes
+ */
+ArenaBlock *createArenaBlock(size_t capacity)
+{
+    ArenaBlock *block = (ArenaBlock *)malloc(ARENA_HEADER_SIZE + capacity);
+    addStat(&stats.arenaMallocs, 1);
+    if (!block)
+    {
+        perror("Memory allocation error for arena block");
+        return NULL;
+    }
+    block->next = NULL;
+    block->capacity = capacity;
+    block->used = 0;
+    return block;
+}
+
+/**
+ * Allocates memory from an arena. The memory is aligned to ARENA_ALIGN bytes
+ * and lives until the arena is freed.
+ *
+ * @return Pointer to the memory, or NULL on allocation failure.
+ */
+void *arenaAlloc(Arena *arena, size_t size)
+{
+    size = ARENA_ALIGN_SIZE(size);
+
+    if (size >= ARENA_LARGE_SIZE)
+    {
+        // Dedicated block, linked behind the current head
+        ArenaBlock *block = createArenaBlock(size);
+        if (!block)
+            return NULL;
+        block->used = size;
+        if (arena->head)
+        {
+            block->next = arena->head->next;
+            arena->head->next = block;
+        }
+        else
+        {
+            arena->head = block;
+        }
+        return arenaBlockData(block);
+    }
+
+    if (!arena->head || arena->head->capacity - arena->head->used < size)
+    {
+        ArenaBlock *block = createArenaBlock(ARENA_BLOCK_SIZE);
+        if (!block)
+            return NULL;
+        block->next = arena->head;
+        arena->head = block;
+    }
+
+    char *ptr = arenaBlockData(arena->head) + arena->head->used;
+    arena->head->used += size;
+    return ptr;
+}
+
+/**
+ * Grows an allocation of an arena, like realloc. The most recent allocation
+ * is extended in place if its block has room, and allocations that own a
+ * block are resized with realloc; anything else is copied.
+ *
+ * @return Pointer to the (possibly moved) memory, or NULL on allocation failure
+ *         (the old allocation stays valid).
+ */
+void *arenaGrow(Arena *arena, void *ptr, size_t oldSize, size_t newSize)
+{
+    oldSize = ARENA_ALIGN_SIZE(oldSize);
+    newSize = ARENA_ALIGN_SIZE(newSize);
+
+    ArenaBlock *head = arena->head;
+    if (head && (char *)ptr + oldSize == arenaBlockData(head) + head->used &&
+        head->capacity - head->used >= newSize - oldSize)
+    {
+        head->used += newSize - oldSize;
+        return ptr;
+    }
+
+    if (oldSize >= ARENA_LARGE_SIZE)
+    {
+        // Find the dedicated block that holds this allocation
+        ArenaBlock **link = &arena->head;
+        while (*link && arenaBlockData(*link) != (char *)ptr)
+        {
+            link = &(*link)->next;
+        }
+        if (*link && (*link)->used == oldSize)
+        {
+            ArenaBlock *block = (ArenaBlock *)realloc(*link, ARENA_HEADER_SIZE + newSize);
+            addStat(&stats.arenaReallocs, 1);
+            if (!block)
+            {
+                perror("Reallocation error for arena block");
+                return NULL;
+            }
+            block->capacity = newSize;
+            block->used = newSize;
+            *link = block;
+            return arenaBlockData(block);
+        }
+    }
+
+    void *newPtr = arenaAlloc(arena, newSize);
+    if (!newPtr)
+        return NULL;
+    memcpy(newPtr, ptr, oldSize);
+    return newPtr;
+}
+
+/**
+ * Releases all memory of an arena
+ */
+void freeArena(Arena *arena)
+{
+    ArenaBlock *block = arena->head;
+    while (block)
+    {
+        ArenaBlock *next = block->next;
+        free(block);
+        block = next;
+    }
+    arena->head = NULL;
+}
+
+/**
+ * A line of text, referenced in place instead of copied
+ */
+typedef struct
+{
+    const char *text; // Start of the line (not null-terminated)
+    size_t length;    // Length of the line in bytes
+    int width;        // Display width, computed once while parsing
+} LineSpan;
+
+/**
+ * Structure for a text paragraph: a range of the document's lines
+ */
+typedef struct
+{
+    size_t firstLine; // Index of the first line in Document.lines
+    size_t lineCount; // Number of lines
+    int width;        // Display width of the widest line, kept up to date as lines are added
+    int wrapWidth;    // Width of the widest row once wrapped, see prepareBlockWidths
+} Paragraph;
+
+/**
+ * Structure for the entire document
+ */
+typedef struct
+{
+    Arena arena;           // Owns the document and everything allocated for it
+    LineSpan *lines;       // Lines of all paragraphs, in order
+    size_t lineCount;      // Number of lines
+    size_t lineCapacity;   // Capacity of the lines array
+    Paragraph *paragraphs; // Array of paragraphs
+    size_t paragraphCount; // Number of paragraphs
+    size_t capacity;       // Capacity of the paragraphs array
+    int wrapColumns;       // Area width the wrapWidth of the paragraphs holds for, 0 if none
+} Document;
+
+/**
+ * Initializes a new document. The document lives in its own arena, which
+ * also provides all memory allocated for it later on.
+ */
+Document *createDocument()
+{
+    Arena arena = {NULL};
+    Document *doc = (Document *)arenaAlloc(&arena, sizeof(Document));
+    if (!doc)
+        return NULL;
+    doc->arena = arena;
+
+    doc->capacity = 8; // Initial capacity
+    doc->paragraphCount = 0;
+    doc->paragraphs = (Paragraph *)arenaAlloc(&doc->arena, doc->capacity * sizeof(Paragraph));
+    doc->lineCapacity = 64; // Initial capacity
+    doc->lineCount = 0;
+    doc->lines = (LineSpan *)arenaAlloc(&doc->arena, doc->lineCapacity * sizeof(LineSpan));
+    doc->wrapColumns = 0;
+
+    if (!doc->paragraphs || !doc->lines)
+    {
+        freeArena(&doc->arena); // Also frees doc
+        return NULL;
+    }
+
+    return doc;
+}
+
+/**
+ * Starts a new, empty paragraph at the end of a document
+ *
+ * @return 0 on success, -1 on allocation failure.
+ */
+int addParagraphToDocument(Document *doc)
+{
+    if (!doc)
+        return -1;
+    if (doc->paragraphCount >= doc->capacity)
+    {
+        size_t newCapacity = doc->capacity * 2;
+        addStat(&stats.documentGrowths, 1);
+        Paragraph *newParagraphs = (Paragraph *)arenaGrow(&doc->arena, doc->paragraphs,
+                                                          doc->capacity * sizeof(Paragraph),
+                                                          newCapacity * sizeof(Paragraph));
+        if (!newParagraphs)
+        {
+            // Paragraph cannot be added
+            return -1;
+        }
+        doc->paragraphs = newParagraphs;
+        doc->capacity = newCapacity;
+    }
+
+    Paragraph *para = &doc->paragraphs[doc->paragraphCount];
+    para->firstLine = doc->lineCount;
+    para->lineCount = 0;
+    para->width = 0;
+    para->wrapWidth = 0;
+    doc->paragraphCount++;
+    return 0;
+}
+
+/**
+ * Adds a line to the last paragraph of a document. The text is not copied
+ * and must stay valid for the lifetime of the document.
+ *
+ * @param width Display width of the line, as returned by getDisplayWidth
+ * @return 0 on success, -1 on allocation failure.
+ */
+int addLineToParagraph(Document *doc, const char *line, size_t length, int width)
+{
+    if (!doc || doc->paragraphCount == 0)
+        return -1;
+    if (doc->lineCount >= doc->lineCapacity)
+    {
+        size_t newCapacity = doc->lineCapacity * 2;
+        addStat(&stats.documentGrowths, 1);
+        LineSpan *newLines = (LineSpan *)arenaGrow(&doc->arena, doc->lines,
+                                                   doc->lineCapacity * sizeof(LineSpan),
+                                                   newCapacity * sizeof(LineSpan));
+        if (!newLines)
+        {
+            // Line cannot be added
+            return -1;
+        }
+        doc->lines = newLines;
+        doc->lineCapacity = newCapacity;
+    }
+
+    doc->lines[doc->lineCount].text = line;
+    doc->lines[doc->lineCount].length = length;
+    doc->lines[doc->lineCount].width = width;
+    doc->lineCount++;
+    Paragraph *para = &doc->paragraphs[doc->paragraphCount - 1];
+    para->lineCount++;
+    if (width > para->width)
+        para->width = width;
+    return 0;
+}
+
+/**
+ * Frees the memory of a document, including everything in its arena
+ */
+void freeDocument(Document *doc)
+{
+    if (!doc)
+        return;
+    Arena arena = doc->arena; // The document itself lives in the arena
+    freeArena(&arena);
+}
+
+/**
+ * Reusable buffers for wrapTextToWidth; kept across calls so wrapping
+ * does not allocate once they have grown to the longest line
+ */
+typedef struct
+{
+    LineSpan *words;          // Words of the text with their display widths
+    size_t wordCount;         // Number of words
+    size_t wordCapacity;      // Capacity of the words array
+    LineSpan *lines;          // Wrapped lines, pointing into text
+    size_t lineCount;         // Number of wrapped lines
+    size_t lineCapacity;      // Capacity of the lines array
+    char *text;               // Wrapped lines, words joined by single spaces
+    size_t textCapacity;      // Capacity of the text buffer
+    unsigned long long *cost; // Best layout cost per word prefix (balanced wrapping)
+    size_t costCapacity;      // Capacity of the cost array
+    size_t *breaks;           // Line breaks per word prefix (balanced wrapping)
+    size_t breakCapacity;     // Capacity of the breaks array
+} WrapBuffer;
+
+/**
+ * Frees the buffers of a WrapBuffer
+ */
+void freeWrapBuffer(WrapBuffer *wrap)
+{
+    free(wrap->words);
+    free(wrap->lines);
+    free(wrap->text);
+    free(wrap->cost);
+    free(wrap->breaks);
+    memset(wrap, 0, sizeof(*wrap));
+}
+
+/**
+ * Makes sure an array of a WrapBuffer has room for the given number of elements
+ *
+ * @return 0 on success, -1 on allocation failure.
+ */
+static int reserveWrapArray(void **array, size_t *capacity, size_t needed, size_t elementSize)
+{
+    if (needed <= *capacity)
+        return 0;
+    size_t newCapacity = *capacity ? *capacity : 64;
+    while (newCapacity < needed)
+    {
+        newCapacity *= 2;
+    }
+    void *newArray = realloc(*array, newCapacity * elementSize);
+    if (!newArray)
+    {
+        perror("Reallocation error for wrap buffer");
+        return -1;
+    }
+    *array = newArray;
+    *capacity = newCapacity;
+    return 0;
+}
+
+/**
+ * Checks for the whitespace that separates words. Only ASCII whitespace
+ * counts, which never occurs inside a UTF-8 multibyte character.
+ */
+static inline int isWordSeparator(char c)
+{
+    return c == ' ' || c == '\t' || c == '\r' || c == '\v' || c == '\f';
+}
+
+/**
+ * Splits a text into words and measures each of them once
+ *
+ * @return 0 on success, -1 on allocation failure.
+ */
+int splitIntoWords(WrapBuffer *wrap, const char *text, size_t length)
+{
+    wrap->wordCount = 0;
+    const char *ptr = text;
+    const char *end = text + length;
+    while (ptr < end)
+    {
+        // Skip leading whitespace
+        while (ptr < end && isWordSeparator(*ptr))
+        {
+            ptr++;
+        }
+        if (ptr == end)
+            break; // End of text reached after whitespace
+
+        // The next word is the sequence up to the next whitespace
+        const char *wordStart = ptr;
+        while (ptr < end && !isWordSeparator(*ptr))
+        {
+            ptr++;
+        }
+
+        if (reserveWrapArray((void **)&wrap->words, &wrap->wordCapacity, wrap->wordCount + 1, sizeof(LineSpan)) < 0)
+            return -1;
+        LineSpan *word = &wrap->words[wrap->wordCount++];
+        word->text = wordStart;
+        word->length = ptr - wordStart;
+        word->width = getDisplayWidth(wordStart, word->length, DEFAULT_TAB_SIZE); // Words hold no tabs
+    }
+    return 0;
+}
+
+/**
+ * Appends the words [first, last) as one line to the wrapped lines,
+ * joined by single spaces.
+ *
+ * @param offset Write offset in wrap->text; advanced past the line
+ * @param width Display width of the line
+ * @return 0 on success, -1 on allocation failure.
+ */
+int addWrappedLine(WrapBuffer *wrap, size_t first, size_t last, size_t *offset, int width)
+{
+    if (reserveWrapArray((void **)&wrap->lines, &wrap->lineCapacity, wrap->lineCount + 1, sizeof(LineSpan)) < 0)
+        return -1;
+
+    char *lineStart = wrap->text + *offset;
+    char *dst = lineStart;
+    for (size_t i = first; i < last; i++)
+    {
+        if (i > first)
+            *dst++ = ' ';
+        memcpy(dst, wrap->words[i].text, wrap->words[i].length);
+        dst += wrap->words[i].length;
+    }
+
+    LineSpan *line = &wrap->lines[wrap->lineCount++];
+    line->text = lineStart;
+    line->length = dst - lineStart;
+    line->width = width;
+    *offset = dst - wrap->text;
+    return 0;
+}
+
+/**
+ * Splits a string at word boundaries to stay within the given maximum width.
+ * Considers the actual display width of UTF-8 characters. Runs of
+ * whitespace are collapsed to single spaces; a word wider than maxWidth
+ * gets a line of its own. Each word is measured once and every byte is
+ * copied once, so the time is linear in the length of the text.
+ *
+ * @param wrap Buffers for the result (wrap->lines), reused across calls
+ * @param text The text to split
+ * @param length Length of the text in bytes
+ * @param maxWidth The maximum width of a line
+ * @return 0 on success, -1 on allocation failure.
+ */
+int wrapTextToWidth(WrapBuffer *wrap, const char *text, size_t length, int maxWidth)
+{
+    wrap->lineCount = 0;
+    if (splitIntoWords(wrap, text, length) < 0)
+        return -1;
+
+    // The wrapped text is never longer than the original
+    if (reserveWrapArray((void **)&wrap->text, &wrap->textCapacity, length, 1) < 0)
+        return -1;
+
+    size_t offset = 0;        // Write offset in wrap->text
+    size_t lineFirstWord = 0; // First word of the current line
+    int currentLineWidth = 0;
+    for (size_t i = 0; i < wrap->wordCount; i++)
+    {
+        int wordWidth = wrap->words[i].width;
+
+        // Check if the word (plus a space) fits on the current line
+        if (i == lineFirstWord)
+        {
+            currentLineWidth = wordWidth;
+        }
+        else if (currentLineWidth + 1 + wordWidth <= maxWidth)
+        {
+            currentLineWidth += 1 + wordWidth;
+        }
+        else
+        {
+            // Word doesn't fit anymore: finalize the current line
+            if (addWrappedLine(wrap, lineFirstWord, i, &offset, currentLineWidth) < 0)
+                return -1;
+            lineFirstWord = i;
+            currentLineWidth = wordWidth;
+        }
+    }
+
+    // Add the last line if it has content
+    if (lineFirstWord < wrap->wordCount)
+    {
+        if (addWrappedLine(wrap, lineFirstWord, wrap->wordCount, &offset, currentLineWidth) < 0)
+            return -1;
+    }
+    return 0;
+}
+
+/**
+ * Splits a string at word boundaries like wrapTextToWidth, but chooses the
+ * breaks that minimize the raggedness of the lines: the sum of the squared
+ * space left on every line, the last one included, since centered lines
+ * are ragged on both sides. The dynamic program only looks back as far as
+ * words fit on one line, so the cost is linear in the number of words times
+ * the words per line, never quadratic in the paragraph length.
+ *
+ * @param wrap Buffers for the result (wrap->lines), reused across calls
+ * @param text The text to split
+ * @param length Length of the text in bytes
+ * @param maxWidth The maximum width of a line
+ * @return 0 on success, -1 on allocation failure.
+ */
+int balanceTextToWidth(WrapBuffer *wrap, const char *text, size_t length, int maxWidth)
+{
+    wrap->lineCount = 0;
+    if (splitIntoWords(wrap, text, length) < 0)
+        return -1;
+    if (reserveWrapArray((void **)&wrap->text, &wrap->textCapacity, length, 1) < 0)
+        return -1;
+
+    size_t wordCount = wrap->wordCount;
+    if (reserveWrapArray((void **)&wrap->cost, &wrap->costCapacity, wordCount + 1, sizeof(unsigned long long)) < 0 ||
+        reserveWrapArray((void **)&wrap->breaks, &wrap->breakCapacity, wordCount + 1, sizeof(size_t)) < 0)
+        return -1;
+
+    // cost[j] is the best cost of setting the first j words; breaks[j] is
+    // the first word of the last line in that layout
+    unsigned long long *cost = wrap->cost;
+    size_t *breaks = wrap->breaks;
+    cost[0] = 0;
+    for (size_t j = 1; j <= wordCount; j++)
+    {
+        cost[j] = ULLONG_MAX;
+        long long lineWidth = -1; // Width of words i..j-1 with single spaces
+        for (size_t i = j; i-- > 0;)
+        {
+            lineWidth += 1 + wrap->words[i].width;
+            if (lineWidth > maxWidth && i + 1 < j)
+                break; // Words before i do not fit on this line either
+
+            // A word wider than maxWidth gets a line of its own at no cost
+            long long slack = lineWidth < maxWidth ? maxWidth - lineWidth : 0;
+            unsigned long long candidate = cost[i] + (unsigned long long)(slack * slack);
+            if (candidate < cost[j])
+            {
+                cost[j] = candidate;
+                breaks[j] = i;
+            }
+            if (lineWidth > maxWidth)
+                break;
+        }
+    }
+
+    // Reverse the chain of breaks so the lines can be emitted front to back:
+    // afterwards breaks[i] is the end of the line that starts at word i
+    size_t next = wordCount;
+    size_t j = wordCount;
+    while (j > 0)
+    {
+        size_t start = breaks[j];
+        breaks[j] = next;
+        next = j;
+        j = start;
+    }
+    breaks[0] = next;
+
+    size_t offset = 0;
+    for (size_t first = 0; first < wordCount; first = breaks[first])
+    {
+        size_t last = breaks[first];
+        int width = (int)(last - first - 1);
+        for (size_t i = first; i < last; i++)
+        {
+            width += wrap->words[i].width;
+        }
+        if (addWrappedLine(wrap, first, last, &offset, width) < 0)
+            return -1;
+    }
+    return 0;
+}
+
+/**
+ * Parses part of a text into a document, continuing its last paragraph.
+ * Empty lines (two adjacent newlines) mark paragraph breaks; the break
+ * state is carried in *paragraphBreak so ranges can be parsed one after
+ * another. Each line is found and measured in one pass by scanLine.
+ *
+ * @param doc The document to add to
+ * @param start Start of the range
+ * @param end End of the range
+ * @param tabSize Columns between tab stops
+ * @param cache Widths of lines seen before, or NULL
+ * @param paragraphBreak In: the next non-empty line starts a paragraph.
+ *                       Out: an empty line followed the last non-empty line.
+ * @return 1 if the range ended at a null byte, 0 at its end, -1 on error.
+ */
+int parseRange(Document *doc, const char *start, const char *end, int tabSize, LineCache *cache, int *paragraphBreak)
+{
+    const char *textPtr = start; // Pointer to the current position in the text
+
+    while (textPtr < end)
+    {
+        int lineWidth;
+        const char *lineEnd = scanLineCached(cache, textPtr, end, tabSize, &lineWidth);
+
+        if (lineEnd > textPtr)
+        {
+            // Start a new paragraph after an empty line (or at the beginning)
+            if (*paragraphBreak || doc->paragraphCount == 0)
+            {
+                if (addParagraphToDocument(doc) < 0)
+                    return -1; // Error during paragraph creation
+                *paragraphBreak = 0;
+            }
+
+            // Add the line to the paragraph as a span into the text. The input's
+            // structure (including line breaks) is preserved; lines that are too
+            // wide are only reflowed when printed with --wrap.
+            if (addLineToParagraph(doc, textPtr, lineEnd - textPtr, lineWidth) < 0)
+                return -1;
+        }
+        else if (lineEnd < end && *lineEnd == '\n')
+        {
+            *paragraphBreak = 1; // Empty line between paragraphs
+        }
+
+        if (lineEnd == end)
+            break; // End of range
+        if (*lineEnd == '\0')
+            return 1; // Null byte ends the text
+
+        // Go to the start of the next line
+        textPtr = lineEnd + 1; // Skip the \n
+    }
+
+    return 0;
+}
+
+/**
+ * Part of the input parsed by one thread of parseDocumentParallel
+ */
+typedef struct
+{
+    const char *start;    // First byte of the chunk (the start of a line)
+    const char *end;      // End of the chunk (just after a newline, or the end of the text)
+    Document *doc;        // Lines and paragraphs of the chunk
+    int tabSize;          // Columns between tab stops
+    int lineCache;        // Parse with a LineCache of the chunk's own
+    int status;           // Result of parseRange
+    int trailingBreak;    // An empty line follows the chunk's last non-empty line
+    LineSpan *lineTarget; // Where the chunk's lines go in the merged document
+} ParseChunk;
+
+/**
+ * Thread function: parses one chunk into its own document
+ */
+static void *parseChunkWorker(void *arg)
+{
+    ParseChunk *chunk = (ParseChunk *)arg;
+    chunk->doc = createDocument();
+    if (!chunk->doc)
+    {
+        chunk->status = -1;
+        return NULL;
+    }
+    LineCache *cache = NULL;
+    if (chunk->lineCache && !(cache = createLineCache()))
+    {
+        chunk->status = -1;
+        return NULL;
+    }
+    chunk->trailingBreak = 0;
+    chunk->status = parseRange(chunk->doc, chunk->start, chunk->end, chunk->tabSize, cache, &chunk->trailingBreak);
+    freeLineCache(cache);
+    return NULL;
+}
+
+/**
+ * Thread function: moves the lines of a parsed chunk into the merged document
+ */
+static void *copyChunkLinesWorker(void *arg)
+{
+    ParseChunk *chunk = (ParseChunk *)arg;
+    memcpy(chunk->lineTarget, chunk->doc->lines, chunk->doc->lineCount * sizeof(LineSpan));
+    freeDocument(chunk->doc);
+    chunk->doc = NULL;
+    return NULL;
+}
+
+/**
+ * Runs a thread function on every chunk, one thread per chunk.
+ *
+ * @return 0 on success, -1 if threads could not be started.
+ */
+static int runChunkWorkers(ParseChunk *chunks, int chunkCount, void *(*worker)(void *))
+{
+    pthread_t threads[MAX_PARSE_THREADS];
+    int started = 0;
+    int result = 0;
+    for (int i = 0; i < chunkCount; i++)
+    {
+        if (pthread_create(&threads[i], NULL, worker, &chunks[i]) != 0)
+        {
+            result = -1;
+            break;
+        }
+        started++;
+    }
+    for (int i = 0; i < started; i++)
+    {
+        pthread_join(threads[i], NULL);
+    }
+    if (result < 0)
+    {
+        fprintf(stderr, "Error: Could not start parser threads.\n");
+    }
+    return result;
+}
+
+/**
+ * Parses a large text on several threads. The text is split at newlines
+ * into one chunk per thread; each thread finds the lines and widths of its
+ * chunk, and the chunk documents are then stitched in order. A chunk's
+ * first paragraph continues the previous chunk's last one unless an empty
+ * line lies between them, so the result is identical to a serial parse.
+ *
+ * @param text The text to parse
+ * @param length Length of the text in bytes
+ * @param tabSize Columns between tab stops
+ * @param threadCount Number of threads (at most MAX_PARSE_THREADS)
+ * @param lineCache Give every thread a LineCache of its own, as the caches are not shared
+ * @return A newly allocated Document structure or NULL on error.
+ */
+Document *parseDocumentParallel(const char *text, size_t length, int tabSize, int threadCount, int lineCache)
+{
+    ParseChunk chunks[MAX_PARSE_THREADS];
+    int chunkCount = 0;
+    const char *textEnd = text + length;
+    const char *chunkStart = text;
+
+    // Split at the first newline after each 1/threadCount of the text
+    for (int part = 0; part < threadCount && chunkStart < textEnd; part++)
+    {
+        const char *chunkEnd = textEnd;
+        if (part < threadCount - 1)
+        {
+            const char *target = text + length / threadCount * (part + 1);
+            if (target < chunkStart)
+                continue; // Previous chunk already extends past this share
+            const char *newline = (const char *)memchr(target, '\n', textEnd - target);
+            chunkEnd = newline ? newline + 1 : textEnd;
+        }
+        memset(&chunks[chunkCount], 0, sizeof(ParseChunk));
+        chunks[chunkCount].start = chunkStart;
+        chunks[chunkCount].end = chunkEnd;
+        chunks[chunkCount].tabSize = tabSize;
+        chunks[chunkCount].lineCache = lineCache;
+        chunkCount++;
+        chunkStart = chunkEnd;
+    }
+
+    Document *doc = createDocument();
+    int failed = !doc || runChunkWorkers(chunks, chunkCount, parseChunkWorker) < 0;
+
+    // Chunks after a null byte are not part of the text
+    int usedChunks = 0;
+    size_t totalLines = 0;
+    while (!failed && usedChunks < chunkCount)
+    {
+        ParseChunk *chunk = &chunks[usedChunks++];
+        if (chunk->status < 0)
+            failed = 1;
+        else
+            totalLines += chunk->doc->lineCount;
+        if (chunk->status == 1)
+            break;
+    }
+
+    LineSpan *lines = NULL;
+    if (!failed)
+    {
+        lines = (LineSpan *)arenaAlloc(&doc->arena, (totalLines ? totalLines : 1) * sizeof(LineSpan));
+        failed = !lines;
+    }
+
+    // Stitch the paragraphs; the lines of all chunks are consecutive
+    int paragraphBreak = 1;
+    size_t lineOffset = 0;
+    for (int i = 0; i < usedChunks && !failed; i++)
+    {
+        ParseChunk *chunk = &chunks[i];
+        chunk->lineTarget = lines + lineOffset;
+
+        // An empty line at the chunk start also separates it from the previous chunk
+        if (*chunk->start == '\n')
+            paragraphBreak = 1;
+
+        for (size_t j = 0; j < chunk->doc->paragraphCount && !failed; j++)
+        {
+            const Paragraph *para = &chunk->doc->paragraphs[j];
+            if (j == 0 && !paragraphBreak && doc->paragraphCount > 0)
+            {
+                // Paragraph continues across the chunk boundary
+                Paragraph *last = &doc->paragraphs[doc->paragraphCount - 1];
+                last->lineCount += para->lineCount;
+                if (para->width > last->width)
+                    last->width = para->width;
+                continue;
+            }
+            if (addParagraphToDocument(doc) < 0)
+            {
+                failed = 1;
+                break;
+            }
+            doc->paragraphs[doc->paragraphCount - 1].firstLine = lineOffset + para->firstLine;
+            doc->paragraphs[doc->paragraphCount - 1].lineCount = para->lineCount;
+            doc->paragraphs[doc->paragraphCount - 1].width = para->width;
+        }
+        if (chunk->doc->paragraphCount > 0)
+            paragraphBreak = chunk->trailingBreak;
+        lineOffset += chunk->doc->lineCount;
+    }
+
+    if (!failed)
+    {
+        failed = runChunkWorkers(chunks, usedChunks, copyChunkLinesWorker) < 0;
+        doc->lines = lines;
+        doc->lineCount = totalLines;
+        doc->lineCapacity = totalLines;
+    }
+
+    for (int i = 0; i < chunkCount; i++)
+    {
+        freeDocument(chunks[i].doc); // Chunks whose lines were not moved
+    }
+    if (failed)
+    {
+        freeDocument(doc);
+        return NULL;
+    }
+    return doc;
+}
+
+/**
+ * Parses a string into a document structure by recognizing paragraphs
+ * (separated by double newlines) and preserving existing line breaks within them.
+ * The lines reference the text in place, so it must outlive the document.
+ * Like the C string it used to be, the text ends at the first null byte.
+ * Texts of at least PARALLEL_PARSE_THRESHOLD bytes are parsed on all CPUs;
+ * with a cache, each of those threads fills a cache of its own instead.
+ *
+ * @param text The text to parse
+ * @param length Length of the text in bytes
+ * @param tabSize Columns between tab stops, for the line widths
+ * @param cache Widths of lines seen before, or NULL
+ * @return A newly allocated Document structure or NULL on error.
+ */
+Document *parseDocument(const char *text, size_t length, int tabSize, LineCache *cache)
+{
+    if (length >= PARALLEL_PARSE_THRESHOLD)
+    {
+        long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+        size_t threads = cpus > 1 ? (size_t)cpus : 1;
+        if (threads > MAX_PARSE_THREADS)
+            threads = MAX_PARSE_THREADS;
+        if (threads > length / PARALLEL_CHUNK_MIN)
+            threads = length / PARALLEL_CHUNK_MIN;
+        if (threads > 1)
+            return parseDocumentParallel(text, length, tabSize, (int)threads, cache != NULL);
+    }
+
+    Document *doc = createDocument();
+    if (!doc)
+        return NULL;
+
+    int paragraphBreak = 1;
+    if (parseRange(doc, text, text + length, tabSize, cache, &paragraphBreak) < 0)
+    {
+        freeDocument(doc); // Cleanup
+        return NULL;
+    }
+    return doc;
+}
+
+/**
+ * Writes all of the given pieces, retrying after partial writes and signals.
+ *
+ * @return 0 on success, -1 on error.
+ */
+int writeAll(int fd, struct iovec *iov, int count)
+{
+    while (count > 0)
+    {
+        ssize_t written = writev(fd, iov, count > IOV_MAX ? IOV_MAX : count);
+        addStat(&stats.writeCalls, 1);
+        if (written < 0)
+        {
+            if (errno == EINTR)
+                continue;
+            return -1;
+        }
+        addStat(&stats.bytesOut, (unsigned long long)written);
+
+        // Skip the pieces that were written completely
+        while (count > 0 && (size_t)written >= iov->iov_len)
+        {
+            written -= iov->iov_len;
+            iov++;
+            count--;
+        }
+        if (count > 0)
+        {
+            iov->iov_base = (char *)iov->iov_base + written;
+            iov->iov_len -= written;
+        }
+    }
+    return 0;
+}
+
+/**
+ * One read or write of the asynchronous I/O layer
+ */
+typedef struct
+{
+    int fd;           // File descriptor of the operation
+    struct iovec iov; // Remaining buffer of the operation
+    int queued;       // Submitted and not completed yet
+    int done;         // Completed; result holds the outcome
+    ssize_t result;   // Bytes transferred, or -1 with error set
+    int error;        // errno of a failed operation
+} AsyncRequest;
+
+#define ASYNC_URING 0   // Requests go through an io_uring
+#define ASYNC_THREADS 1 // Requests are carried out by a reader and a writer thread
+#define ASYNC_SYNC 2    // Writes are carried out at once, reads when they are waited for
+
+/**
+ * Asynchronous I/O with at most one read and one write in flight, so
+ * reading the next chunk and writing the previous output overlap with
+ * centering the current chunk. Uses io_uring where the kernel offers it
+ * and falls back to two threads, or to plain blocking calls if those
+ * cannot be started.
+ */
+typedef struct
+{
+    int mode;                  // ASYNC_URING, ASYNC_THREADS or ASYNC_SYNC
+    AsyncRequest read;         // The read in flight
+    AsyncRequest write;        // The write in flight
+    AsyncRequest cancel;       // Cancellation of the read at shutdown
+#ifdef CNTR_IO_URING
+    int ring;                  // io_uring file descriptor
+    void *sqRing;              // Mapping of the submission ring
+    size_t sqRingSize;         // Size of the submission ring mapping
+    void *cqRing;              // Mapping of the completion ring (may equal sqRing)
+    size_t cqRingSize;         // Size of the completion ring mapping
+    struct io_uring_sqe *sqes; // Submission queue entries
+    size_t sqesSize;           // Size of the entries mapping
+    unsigned *sqTail;          // Ring indices, shared with the kernel
+    unsigned *sqMask;
+    unsigned *sqArray;
+    unsigned *cqHead;
+    unsigned *cqTail;
+    unsigned *cqMask;
+    struct io_uring_cqe *cqes;
+#endif
+    pthread_t reader;          // Threads of ASYNC_THREADS
+    pthread_t writer;
+    int stopping;              // The threads are asked to exit
+    pthread_mutex_t lock;
+    pthread_cond_t changed;    // Signaled whenever a request changes state
+} AsyncIo;
+
+#ifdef CNTR_IO_URING
+#define ASYNC_READ_TAG 1   // user_data of read completions
+#define ASYNC_WRITE_TAG 2  // user_data of write completions
+#define ASYNC_CANCEL_TAG 3 // user_data of cancel completions
+
+#ifndef IORING_FEAT_RW_CUR_POS
+#define IORING_FEAT_RW_CUR_POS (1U << 3) // Missing from kernel headers before 5.6
+#endif
+
+/**
+ * Sets up an io_uring with room for the read, the write and a cancel.
+ * Requires IORING_FEAT_NODROP (Linux 5.5), which also guarantees that
+ * pending requests can be cancelled, and IORING_FEAT_RW_CUR_POS (Linux
+ * 5.6), without which the offset -1 of the requests is rejected with
+ * EINVAL; older kernels use the thread fallback.
+ *
+ * @return 0 on success, -1 if io_uring is not available.
+ */
+static int setupUring(AsyncIo *io)
+{
+    struct io_uring_params params;
+    memset(&params, 0, sizeof(params));
+    io->ring = (int)syscall(__NR_io_uring_setup, 4, &params);
+    if (io->ring < 0)
+        return -1;
+    if (!(params.features & IORING_FEAT_NODROP) || !(params.features & IORING_FEAT_RW_CUR_POS))
+    {
+        close(io->ring);
+        return -1;
+    }
+
+    io->sqRingSize = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+    io->cqRingSize = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+    if (params.features & IORING_FEAT_SINGLE_MMAP)
+    {
+        if (io->cqRingSize > io->sqRingSize)
+            io->sqRingSize = io->cqRingSize;
+        io->cqRingSize = 0; // Shares the submission ring mapping
+    }
+    io->sqes = MAP_FAILED;
+    io->cqRing = MAP_FAILED;
+    io->sqRing = mmap(NULL, io->sqRingSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, io->ring,
+                      IORING_OFF_SQ_RING);
+    if (io->sqRing != MAP_FAILED)
+    {
+        io->cqRing = io->cqRingSize == 0 ? io->sqRing
+                                         : mmap(NULL, io->cqRingSize, PROT_READ | PROT_WRITE,
+                                                MAP_SHARED | MAP_POPULATE, io->ring, IORING_OFF_CQ_RING);
+        io->sqesSize = params.sq_entries * sizeof(struct io_uring_sqe);
+        io->sqes = (struct io_uring_sqe *)mmap(NULL, io->sqesSize, PROT_READ | PROT_WRITE,
+                                               MAP_SHARED | MAP_POPULATE, io->ring, IORING_OFF_SQES);
+    }
+    if (io->sqRing == MAP_FAILED || io->cqRing == MAP_FAILED || io->sqes == MAP_FAILED)
+    {
+        if (io->sqes != MAP_FAILED)
+            munmap(io->sqes, io->sqesSize);
+        if (io->cqRing != MAP_FAILED && io->cqRingSize > 0)
+            munmap(io->cqRing, io->cqRingSize);
+        if (io->sqRing != MAP_FAILED)
+            munmap(io->sqRing, io->sqRingSize);
+        close(io->ring);
+        return -1;
+    }
+
+    char *sq = (char *)io->sqRing;
+    char *cq = (char *)io->cqRing;
+    io->sqTail = (unsigned *)(sq + params.sq_off.tail);
+    io->sqMask = (unsigned *)(sq + params.sq_off.ring_mask);
+    io->sqArray = (unsigned *)(sq + params.sq_off.array);
+    io->cqHead = (unsigned *)(cq + params.cq_off.head);
+    io->cqTail = (unsigned *)(cq + params.cq_off.tail);
+    io->cqMask = (unsigned *)(cq + params.cq_off.ring_mask);
+    io->cqes = (struct io_uring_cqe *)(cq + params.cq_off.cqes);
+    return 0;
+}
+
+/**
+ * Queues one operation on the ring and submits it.
+ *
+ * @return 0 on success, -1 with errno set on error.
+ */
+static int submitUring(AsyncIo *io, int opcode, int fd, const void *addr, unsigned length, uint64_t tag)
+{
+    unsigned tail = *io->sqTail;
+    unsigned index = tail & *io->sqMask;
+    struct io_uring_sqe *sqe = &io->sqes[index];
+    memset(sqe, 0, sizeof(*sqe));
+    sqe->opcode = (uint8_t)opcode;
+    sqe->fd = fd;
+    sqe->addr = (uint64_t)(uintptr_t)addr;
+    sqe->len = length;
+    if (opcode != IORING_OP_ASYNC_CANCEL)
+        sqe->off = (uint64_t)-1; // Current file position (IORING_FEAT_RW_CUR_POS); ignored for pipes
+    sqe->user_data = tag;
+    io->sqArray[index] = index;
+    __atomic_store_n(io->sqTail, tail + 1, __ATOMIC_RELEASE);
+
+    while (syscall(__NR_io_uring_enter, io->ring, 1, 0, 0, NULL, 0) < 0)
+    {
+        if (errno != EINTR)
+            return -1;
+    }
+    return 0;
+}
+
+/**
+ * Collects completed operations from the ring.
+ *
+ * @param wait Block until at least one more operation has completed.
+ */
+static void reapUring(AsyncIo *io, int wait)
+{
+    for (;;)
+    {
+        unsigned head = *io->cqHead;
+        unsigned tail = __atomic_load_n(io->cqTail, __ATOMIC_ACQUIRE);
+        if (head != tail)
+        {
+            struct io_uring_cqe *cqe = &io->cqes[head & *io->cqMask];
+            AsyncRequest *request = cqe->user_data == ASYNC_READ_TAG    ? &io->read
+                                    : cqe->user_data == ASYNC_WRITE_TAG ? &io->write
+                                                                        : &io->cancel;
+            request->result = cqe->res < 0 ? -1 : cqe->res;
+            request->error = cqe->res < 0 ? -cqe->res : 0;
+            request->done = 1;
+            __atomic_store_n(io->cqHead, head + 1, __ATOMIC_RELEASE);
+            wait = 0;
+            continue;
+        }
+        if (!wait)
+            return;
+        if (syscall(__NR_io_uring_enter, io->ring, 0, 1, IORING_ENTER_GETEVENTS, NULL, 0) < 0 && errno != EINTR)
+            return;
+    }
+}
+
+/**
+ * Submits a request to the ring, recording a failed submission as its result
+ */
+static void startUring(AsyncIo *io, AsyncRequest *request, int opcode, uint64_t tag)
+{
+    request->done = 0;
+    if (opcode == IORING_OP_WRITEV)
+        addStat(&stats.writeCalls, 1);
+    if (submitUring(io, opcode, request->fd, &request->iov, 1, tag) < 0)
+    {
+        request->result = -1;
+        request->error = errno;
+        request->done = 1;
+    }
+}
+#endif
+
+/**
+ * Body of the ASYNC_THREADS threads: carries out the reads or the writes
+ * of the layer as they are started.
+ */
+static void *asyncIoThread(AsyncIo *io, AsyncRequest *request, int isWrite)
+{
+    // Only a blocking read may be cancelled, see freeAsyncIo
+    pthread_setcancelstate(PTHREAD_CANCEL_DISABLE, NULL);
+    pthread_mutex_lock(&io->lock);
+    for (;;)
+    {
+        while (!(request->queued && !request->done) && !io->stopping)
+        {
+            pthread_cond_wait(&io->changed, &io->lock);
+        }
+        if (io->stopping)
+            break;
+        pthread_mutex_unlock(&io->lock);
+
+        ssize_t result;
+        if (isWrite)
+        {
+            struct iovec iov = request->iov;
+            result = writeAll(request->fd, &iov, 1) < 0 ? -1 : (ssize_t)request->iov.iov_len;
+        }
+        else
+        {
+            do
+            {
+                pthread_setcancelstate(PTHREAD_CANCEL_ENABLE, NULL);
+                result = read(request->fd, request->iov.iov_base, request->iov.iov_len);
+                pthread_setcancelstate(PTHREAD_CANCEL_DISABLE, NULL);
+            } while (result < 0 && errno == EINTR);
+        }
+        int error = errno;
+
+        pthread_mutex_lock(&io->lock);
+        request->result = result;
+        request->error = result < 0 ? error : 0;
+        request->done = 1;
+        pthread_cond_broadcast(&io->changed);
+    }
+    pthread_mutex_unlock(&io->lock);
+    return NULL;
+}
+
+static void *asyncReaderThread(void *arg)
+{
+    AsyncIo *io = (AsyncIo *)arg;
+    return asyncIoThread(io, &io->read, 0);
+}
+
+static void *asyncWriterThread(void *arg)
+{
+    AsyncIo *io = (AsyncIo *)arg;
+    return asyncIoThread(io, &io->write, 1);
+}
+
+/**
+ * Sets up the asynchronous I/O layer, picking the best available mode
+ *
+ * @param background 0 to carry out all requests synchronously, for callers
+ *                   that must not have other threads take their signals.
+ */
+void initAsyncIo(AsyncIo *io, int background)
+{
+    memset(io, 0, sizeof(*io));
+    if (!background)
+    {
+        io->mode = ASYNC_SYNC;
+        pthread_mutex_init(&io->lock, NULL);
+        pthread_cond_init(&io->changed, NULL);
+        return;
+    }
+#ifdef CNTR_IO_URING
+    if (setupUring(io) == 0)
+    {
+        io->mode = ASYNC_URING;
+        return;
+    }
+#endif
+
+    io->mode = ASYNC_SYNC;
+    pthread_mutex_init(&io->lock, NULL);
+    pthread_cond_init(&io->changed, NULL);
+    if (pthread_create(&io->reader, NULL, asyncReaderThread, io) != 0)
+        return;
+    if (pthread_create(&io->writer, NULL, asyncWriterThread, io) != 0)
+    {
+        pthread_mutex_lock(&io->lock);
+        io->stopping = 1;
+        pthread_cond_broadcast(&io->changed);
+        pthread_mutex_unlock(&io->lock);
+        pthread_join(io->reader, NULL);
+        io->stopping = 0;
+        return;
+    }
+    io->mode = ASYNC_THREADS;
+}
+
+/**
+ * Starts a read or write of the layer
+ */
+static void startAsyncRequest(AsyncIo *io, AsyncRequest *request, int fd, void *buffer, size_t length)
+{
+    if (io->mode == ASYNC_THREADS)
+        pthread_mutex_lock(&io->lock);
+    request->fd = fd;
+    request->iov.iov_base = buffer;
+    request->iov.iov_len = length;
+    request->queued = 1;
+    request->done = 0;
+#ifdef CNTR_IO_URING
+    if (io->mode == ASYNC_URING)
+    {
+        int isRead = request == &io->read;
+        startUring(io, request, isRead ? IORING_OP_READV : IORING_OP_WRITEV,
+                   isRead ? ASYNC_READ_TAG : ASYNC_WRITE_TAG);
+        return;
+    }
+#endif
+    if (io->mode == ASYNC_THREADS)
+    {
+        pthread_cond_broadcast(&io->changed);
+        pthread_mutex_unlock(&io->lock);
+    }
+    else if (request == &io->write)
+    {
+        // Without threads a write is carried out at once, so output is not
+        // held back while the next read blocks
+        struct iovec iov = request->iov;
+        request->result = writeAll(fd, &iov, 1) < 0 ? -1 : (ssize_t)length;
+        request->error = request->result < 0 ? errno : 0;
+        request->done = 1;
+    }
+}
+
+/**
+ * Waits for a read or write of the layer to complete
+ */
+static void waitAsyncRequest(AsyncIo *io, AsyncRequest *request)
+{
+    if (io->mode == ASYNC_THREADS)
+    {
+        pthread_mutex_lock(&io->lock);
+        while (!request->done)
+        {
+            pthread_cond_wait(&io->changed, &io->lock);
+        }
+        request->queued = 0;
+        pthread_mutex_unlock(&io->lock);
+        return;
+    }
+#ifdef CNTR_IO_URING
+    else if (io->mode == ASYNC_URING)
+    {
+        while (!request->done)
+        {
+            reapUring(io, 1);
+        }
+    }
+#endif
+    else if (request == &io->read)
+    {
+        // Without threads a read is carried out when it is waited for
+        do
+        {
+            request->result = read(request->fd, request->iov.iov_base, request->iov.iov_len);
+        } while (request->result < 0 && errno == EINTR);
+        request->error = request->result < 0 ? errno : 0;
+    }
+    request->queued = 0;
+}
+
+/**
+ * Starts reading into a buffer; the result is collected with waitAsyncRead
+ */
+void startAsyncRead(AsyncIo *io, int fd, char *buffer, size_t length)
+{
+    startAsyncRequest(io, &io->read, fd, buffer, length);
+}
+
+/**
+ * Waits for the read started by startAsyncRead.
+ *
+ * @return Bytes read, 0 at end of input, or -1 with errno set on error.
+ */
+ssize_t waitAsyncRead(AsyncIo *io)
+{
+    if (!io->read.queued)
+        return 0;
+    waitAsyncRequest(io, &io->read);
+    errno = io->read.error;
+    return io->read.result;
+}
+
+/**
+ * Checks whether the started read has data, waiting for it at most the
+ * given time, so callers can tell that the input pauses.
+ *
+ * @param timeout Milliseconds to wait, 0 to check without blocking.
+ */
+int asyncReadReady(AsyncIo *io, int timeout)
+{
+    if (!io->read.queued)
+        return 1;
+    if (io->mode == ASYNC_THREADS)
+    {
+        struct timespec deadline;
+        clock_gettime(CLOCK_REALTIME, &deadline);
+        deadline.tv_sec += timeout / 1000;
+        deadline.tv_nsec += (long)(timeout % 1000) * 1000000;
+        if (deadline.tv_nsec >= 1000000000)
+        {
+            deadline.tv_sec++;
+            deadline.tv_nsec -= 1000000000;
+        }
+        pthread_mutex_lock(&io->lock);
+        while (!io->read.done && timeout > 0 && pthread_cond_timedwait(&io->changed, &io->lock, &deadline) == 0)
+        {
+        }
+        int done = io->read.done;
+        pthread_mutex_unlock(&io->lock);
+        return done;
+    }
+#ifdef CNTR_IO_URING
+    if (io->mode == ASYNC_URING)
+    {
+        // The ring descriptor polls readable while completions are queued
+        reapUring(io, 0);
+        while (!io->read.done && timeout > 0)
+        {
+            struct pollfd pfd = {io->ring, POLLIN, 0};
+            if (poll(&pfd, 1, timeout) <= 0)
+                break;
+            reapUring(io, 0);
+        }
+        return io->read.done;
+    }
+#endif
+    struct pollfd pfd = {io->read.fd, POLLIN, 0};
+    return poll(&pfd, 1, timeout) > 0;
+}
+
+/**
+ * Starts writing a buffer completely; it must stay untouched until
+ * waitAsyncWrite returns
+ */
+void startAsyncWrite(AsyncIo *io, int fd, const char *buffer, size_t length)
+{
+    startAsyncRequest(io, &io->write, fd, (void *)buffer, length);
+}
+
+/**
+ * Waits for the write started by startAsyncWrite, including the rest of
+ * a short write.
+ *
+ * @return 0 on success (or if no write is in flight), -1 with errno set on error.
+ */
+int waitAsyncWrite(AsyncIo *io)
+{
+    if (!io->write.queued)
+        return 0;
+#ifdef CNTR_IO_URING
+    if (io->mode == ASYNC_URING)
+    {
+        for (;;)
+        {
+            while (!io->write.done)
+            {
+                reapUring(io, 1);
+            }
+            if (io->write.result < 0 && io->write.error != EINTR && io->write.error != EAGAIN)
+                break;
+            size_t written = io->write.result < 0 ? 0 : (size_t)io->write.result;
+            addStat(&stats.bytesOut, written);
+            if (written >= io->write.iov.iov_len)
+                break;
+            // Short write: submit the rest
+            io->write.iov.iov_base = (char *)io->write.iov.iov_base + written;
+            io->write.iov.iov_len -= written;
+            startUring(io, &io->write, IORING_OP_WRITEV, ASYNC_WRITE_TAG);
+        }
+        io->write.queued = 0;
+        errno = io->write.error;
+        return io->write.result < 0 ? -1 : 0;
+    }
+#endif
+    waitAsyncRequest(io, &io->write);
+    errno = io->write.error;
+    return io->write.result < 0 ? -1 : 0;
+}
+
+/**
+ * Shuts the layer down. A read still in flight (the input ended at a null
+ * byte) is cancelled, so its buffer may be freed afterwards; a write must
+ * have been waited for.
+ */
+void freeAsyncIo(AsyncIo *io)
+{
+#ifdef CNTR_IO_URING
+    if (io->mode == ASYNC_URING)
+    {
+        if (io->read.queued && !io->read.done)
+        {
+            // Cancel the read and wait for its completion. If the kernel
+            // cannot cancel it, the process is about to exit anyway.
+            if (submitUring(io, IORING_OP_ASYNC_CANCEL, -1, (void *)(uintptr_t)ASYNC_READ_TAG, 0,
+                            ASYNC_CANCEL_TAG) == 0)
+            {
+                while (!io->read.done && !(io->cancel.done && io->cancel.result < 0))
+                {
+                    reapUring(io, 1);
+                }
+            }
+        }
+        munmap(io->sqes, io->sqesSize);
+        if (io->cqRingSize > 0)
+            munmap(io->cqRing, io->cqRingSize);
+        munmap(io->sqRing, io->sqRingSize);
+        close(io->ring);
+        return;
+    }
+#endif
+    if (io->mode == ASYNC_THREADS)
+    {
+        pthread_mutex_lock(&io->lock);
+        io->stopping = 1;
+        int readBlocked = io->read.queued && !io->read.done;
+        pthread_cond_broadcast(&io->changed);
+        pthread_mutex_unlock(&io->lock);
+        if (readBlocked)
+            pthread_cancel(io->reader); // Only reaches the thread inside read()
+        pthread_join(io->reader, NULL);
+        pthread_join(io->writer, NULL);
+    }
+    pthread_cond_destroy(&io->changed);
+    pthread_mutex_destroy(&io->lock);
+}
+
+/**
+ * Buffered output stage. Small pieces (padding, short lines, newlines) are
+ * collected in one buffer that is written with a single call when full;
+ * pieces too large to be worth copying are written together with the
+ * buffered data by one writev call. With asynchronous output, a full buffer
+ * is handed to the I/O layer and filling continues in a second one; a
+ * writer to a pipe can instead pass full buffers to the reader without
+ * copying. A writer without a file descriptor collects all output in its
+ * (growing) buffer instead.
+ */
+typedef struct
+{
+    int fd;          // Destination file descriptor, or -1 to keep the output in memory
+    char *buffer;    // Pending output
+    size_t length;   // Number of pending bytes
+    size_t capacity; // Capacity of the buffer
+    int error;       // A write failed; further output is discarded
+    AsyncIo *io;     // Writes full buffers in the background, or NULL
+    char *spare;     // Buffer being written (io) or still in the pipe (splice)
+    int splice;      // fd is a pipe that full buffers are handed to with vmsplice
+    size_t mapped;   // Size of buffer and spare if they are mappings (splice), 0 if from malloc
+} OutputWriter;
+
+/** Run of spaces that padding is copied from */
+static const char SPACES[256] = {[0 ... 255] = ' '};
+
+/**
+ * Initializes an output writer for a file descriptor (or -1 for memory)
+ *
+ * @return 0 on success, -1 on allocation failure.
+ */
+int initOutputWriter(OutputWriter *out, int fd)
+{
+    out->fd = fd;
+    out->length = 0;
+    out->capacity = OUTPUT_BUFFER_SIZE;
+    out->error = 0;
+    out->io = NULL;
+    out->spare = NULL;
+    out->splice = 0;
+    out->mapped = 0;
+    out->buffer = (char *)malloc(out->capacity);
+    if (!out->buffer)
+    {
+        perror("Memory allocation error for output buffer");
+        return -1;
+    }
+    return 0;
+}
+
+/**
+ * Grows the buffer of an in-memory writer to hold at least the given number of bytes
+ *
+ * @return 0 on success, -1 on allocation failure.
+ */
+int growOutputWriter(OutputWriter *out, size_t needed)
+{
+    size_t newCapacity = out->capacity;
+    while (newCapacity < needed)
+    {
+        newCapacity *= 2;
+    }
+    char *newBuffer = (char *)realloc(out->buffer, newCapacity);
+    if (!newBuffer)
+    {
+        perror("Reallocation error for output buffer");
+        out->error = 1;
+        return -1;
+    }
+    out->buffer = newBuffer;
+    out->capacity = newCapacity;
+    return 0;
+}
+
+/**
+ * Makes a writer hand full buffers to the asynchronous I/O layer instead
+ * of writing them itself. Since the write of a buffer completes later,
+ * large pieces are then copied as well, as their memory may be reused.
+ *
+ * @return 0 on success, -1 on allocation failure.
+ */
+int setOutputWriterAsync(OutputWriter *out, AsyncIo *io)
+{
+    out->spare = (char *)malloc(out->capacity);
+    if (!out->spare)
+    {
+        perror("Memory allocation error for output buffer");
+        return -1;
+    }
+    out->io = io;
+    return 0;
+}
+
+/**
+ * Makes a writer to a pipe hand its buffers to the pipe with vmsplice, so
+ * the reader gets the pages without a copy into the kernel. The writer
+ * gets two page-aligned buffers of exactly the pipe's size and alternates
+ * between them. Only full buffers are spliced: once a full buffer has
+ * entered the pipe, every page spliced before it has been consumed, so the
+ * other buffer may be refilled. Partial flushes are written (copied) as
+ * usual. Like any vmsplice user, this assumes the reader does not keep
+ * references to the pages (e.g. by splicing them on). The buffers are
+ * anonymous mappings rather than heap memory: when the writer is freed,
+ * munmap leaves the pages still in the pipe to it, whereas freed heap
+ * memory would be handed out and overwritten before the reader gets to it.
+ *
+ * @return 1 if the writer now splices, 0 if its fd is not a pipe, -1 on allocation failure.
+ */
+int setOutputWriterSplice(OutputWriter *out)
+{
+    struct stat st;
+    if (out->fd < 0 || fstat(out->fd, &st) == -1 || !S_ISFIFO(st.st_mode))
+        return 0;
+    int pipeSize = fcntl(out->fd, F_GETPIPE_SZ);
+    long pageSize = sysconf(_SC_PAGESIZE);
+    if (pipeSize <= 0 || pageSize <= 0 || pipeSize % pageSize != 0)
+        return 0;
+
+    void *buffer = mmap(NULL, pipeSize, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (buffer == MAP_FAILED)
+    {
+        perror("Memory allocation error for output buffer");
+        return -1;
+    }
+    void *spare = mmap(NULL, pipeSize, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (spare == MAP_FAILED)
+    {
+        perror("Memory allocation error for output buffer");
+        munmap(buffer, pipeSize);
+        return -1;
+    }
+    memcpy(buffer, out->buffer, out->length < (size_t)pipeSize ? out->length : (size_t)pipeSize);
+    free(out->buffer);
+    out->buffer = (char *)buffer;
+    out->spare = (char *)spare;
+    out->capacity = pipeSize;
+    out->splice = 1;
+    out->mapped = pipeSize;
+    return 1;
+}
+
+/**
+ * Hands a full buffer to the pipe of a splicing writer.
+ *
+ * @return 0 on success, -1 on error.
+ */
+static int spliceAll(OutputWriter *out, char *data, size_t length)
+{
+    struct iovec iov = {data, length};
+    while (iov.iov_len > 0)
+    {
+        ssize_t spliced = vmsplice(out->fd, &iov, 1, 0);
+        addStat(&stats.writeCalls, 1);
+        if (spliced < 0)
+        {
+            if (errno == EINTR)
+                continue;
+            if (errno == EINVAL || errno == ENOSYS)
+            {
+                // Splicing is not possible here after all: copy from now on
+                out->splice = 0;
+                return writeAll(out->fd, &iov, 1);
+            }
+            return -1;
+        }
+        iov.iov_base = (char *)iov.iov_base + spliced;
+        iov.iov_len -= spliced;
+        addStat(&stats.bytesOut, (unsigned long long)spliced);
+    }
+    return 0;
+}
+
+/**
+ * Hands the pending output and an optional extra piece to the file
+ * descriptor, the pipe or the background writer.
+ */
+static void writeOutput(OutputWriter *out, const char *data, size_t length)
+{
+    if (out->splice && out->length == out->capacity && length == 0)
+    {
+        // Full buffer: pass its pages on and fill the other one meanwhile
+        char *full = out->buffer;
+        out->buffer = out->spare;
+        out->spare = full;
+        out->length = 0;
+        if (!out->error && spliceAll(out, full, out->capacity) < 0)
+        {
+            perror("Error writing output");
+            out->error = 1;
+        }
+        return;
+    }
+
+    if (out->io)
+    {
+        // Wait for the previous buffer, then start writing this one
+        if (out->length == 0 || out->error)
+        {
+            out->length = 0;
+            return;
+        }
+        if (waitAsyncWrite(out->io) < 0)
+        {
+            perror("Error writing output");
+            out->error = 1;
+            out->length = 0;
+            return;
+        }
+        char *full = out->buffer;
+        out->buffer = out->spare;
+        out->spare = full;
+        startAsyncWrite(out->io, out->fd, full, out->length);
+        out->length = 0;
+        return;
+    }
+
+    struct iovec iov[2];
+    int count = 0;
+    if (out->length > 0)
+    {
+        iov[count].iov_base = out->buffer;
+        iov[count].iov_len = out->length;
+        count++;
+    }
+    if (length > 0)
+    {
+        iov[count].iov_base = (void *)data;
+        iov[count].iov_len = length;
+        count++;
+    }
+    out->length = 0;
+
+    if (count == 0 || out->error)
+        return;
+    if (writeAll(out->fd, iov, count) < 0)
+    {
+        perror("Error writing output");
+        out->error = 1;
+    }
+}
+
+/**
+ * Writes the pending output together with an optional extra piece.
+ */
+void flushOutputWriterWith(OutputWriter *out, const char *data, size_t length)
+{
+    if (out->fd < 0)
+        return; // In-memory output stays in the buffer
+    unsigned long long start = statsClock();
+    writeOutput(out, data, length);
+    addStatTime(&stats.writeNanos, start);
+}
+
+/**
+ * Writes all pending output
+ *
+ * @return 0 if all output so far was written, -1 on error.
+ */
+int flushOutputWriter(OutputWriter *out)
+{
+    flushOutputWriterWith(out, NULL, 0);
+    return out->error ? -1 : 0;
+}
+
+/**
+ * Appends bytes to the output
+ */
+void writerAppend(OutputWriter *out, const char *data, size_t length)
+{
+    if (length >= DIRECT_WRITE_SIZE && out->fd >= 0 && !out->io && !out->splice)
+    {
+        // Large piece: write it directly instead of copying it
+        flushOutputWriterWith(out, data, length);
+        return;
+    }
+    if (out->capacity - out->length < length)
+    {
+        if (out->fd < 0)
+        {
+            if (growOutputWriter(out, out->length + length) < 0)
+                return;
+        }
+        else
+        {
+            // Fill up and flush the buffer until the rest fits
+            while (out->capacity - out->length < length)
+            {
+                size_t n = out->capacity - out->length;
+                memcpy(out->buffer + out->length, data, n);
+                out->length += n;
+                data += n;
+                length -= n;
+                flushOutputWriter(out);
+            }
+        }
+    }
+    memcpy(out->buffer + out->length, data, length);
+    out->length += length;
+}
+
+/**
+ * Appends a run of spaces to the output
+ */
+void writerPad(OutputWriter *out, size_t count)
+{
+    while (count > 0)
+    {
+        size_t n = count < sizeof(SPACES) ? count : sizeof(SPACES);
+        writerAppend(out, SPACES, n);
+        count -= n;
+    }
+}
+
+/**
+ * Appends a single character to the output
+ */
+static inline void writerPutChar(OutputWriter *out, char c)
+{
+    if (out->length == out->capacity)
+    {
+        if (out->fd >= 0)
+            flushOutputWriter(out);
+        else if (growOutputWriter(out, out->length + 1) < 0)
+            return;
+    }
+    out->buffer[out->length++] = c;
+}
+
+/**
+ * Appends text to the output with its tabs replaced by spaces up to the
+ * next tab stop, using the same columns as the width computation. Text
+ * without tabs is appended as it is after a single memchr.
+ *
+ * @param tabSize Columns between tab stops
+ */
+void writerAppendExpandingTabs(OutputWriter *out, const char *data, size_t length, int tabSize)
+{
+    int column = 0;
+    const char *end = data + length;
+    const char *tab;
+    while ((tab = (const char *)memchr(data, '\t', end - data)) != NULL)
+    {
+        writerAppend(out, data, tab - data);
+        column += getDisplayWidth(data, tab - data, tabSize);
+        int spaces = tabSize - column % tabSize;
+        writerPad(out, spaces);
+        column += spaces;
+        data = tab + 1;
+    }
+    writerAppend(out, data, end - data);
+}
+
+/**
+ * Flushes and releases an output writer
+ *
+ * @return 0 if all output was written, -1 on error.
+ */
+int freeOutputWriter(OutputWriter *out)
+{
+    int result = flushOutputWriter(out);
+    unsigned long long start = statsClock();
+    int waited = out->io ? waitAsyncWrite(out->io) : 0;
+    addStatTime(&stats.writeNanos, start);
+    if (waited < 0)
+    {
+        if (!out->error)
+            perror("Error writing output");
+        result = -1;
+    }
+    if (out->mapped)
+    {
+        // The pipe keeps its own references to pages not yet read
+        munmap(out->buffer, out->mapped);
+        munmap(out->spare, out->mapped);
+    }
+    else
+    {
+        free(out->buffer);
+        free(out->spare);
+    }
+    out->buffer = NULL;
+    out->spare = NULL;
+    out->mapped = 0;
+    return result;
+}
+
+#define BLOCK_NONE 0      // Every line is centered on its own
+#define BLOCK_PARAGRAPH 1 // The lines of a paragraph share one left padding
+#define BLOCK_DOCUMENT 2  // All lines share one left padding
+
+#define ALIGN_CENTER 0 // Lines are centered in the area
+#define ALIGN_LEFT 1   // Lines start at the left edge of the area
+#define ALIGN_RIGHT 2  // Lines end at the right edge of the area
+
+/**
+ * Settings that control how lines are laid out
+ */
+typedef struct
+{
+    int terminalWidth; // Width of the area lines are aligned in; the terminal's unless fixedWidth
+    int fixedWidth;    // The width was given (--width, --columns); resizes do not change it
+    int align;         // ALIGN_CENTER, ALIGN_LEFT or ALIGN_RIGHT
+    int offset;        // Columns left of the area
+    int wrap;          // Reflow lines wider than the terminal at word boundaries
+    int balance;       // When wrapping, choose breaks that even out line widths
+    int block;         // BLOCK_NONE, BLOCK_PARAGRAPH or BLOCK_DOCUMENT
+    int blockWidth;    // Width the document is aligned by for BLOCK_DOCUMENT, see prepareBlockWidths
+    int tabSize;       // Columns between tab stops
+    int expandTabs;    // Print tabs as spaces up to the next tab stop
+    int follow;        // Redraw the last screen of lines whenever the terminal is resized
+    int header;        // Print the name of each file above its lines
+    int lineCache;     // Take the widths of repeated short lines from a LineCache
+} RenderOptions;
+
+/**
+ * Picks up a width change reported by SIGWINCH; cheap enough to call for
+ * every line.
+ *
+ * @return 1 if options->terminalWidth changed, 0 otherwise.
+ */
+static inline int refreshTerminalWidth(RenderOptions *options)
+{
+    int width = cachedTerminalWidth;
+    if (width <= 0 || width == options->terminalWidth || options->fixedWidth)
+        return 0;
+    options->terminalWidth = width;
+    return 1;
+}
+
+/**
+ * Computes the indentation that aligns a line of the given width in the
+ * area of the layout. A line wider than the area starts at its left edge.
+ */
+static inline int linePadding(const RenderOptions *options, int displayWidth)
+{
+    int slack = options->terminalWidth - displayWidth;
+    if (slack < 0)
+        slack = 0; // Prevent negative padding if line is wider than the area
+    if (options->align == ALIGN_LEFT)
+        slack = 0;
+    else if (options->align == ALIGN_CENTER)
+        slack /= 2;
+    return options->offset + slack;
+}
+
+/**
+ * Prints a single line centered on the terminal, or aligned as set in the
+ * options.
+ *
+ * @param out Writer to print to.
+ * @param line The line to print (without trailing newline, not null-terminated).
+ * @param length Length of the line in bytes.
+ * @param displayWidth Display width of the line.
+ * @param options Layout settings.
+ */
+void printCenteredLine(OutputWriter *out, const char *line, size_t length, int displayWidth,
+                       const RenderOptions *options)
+{
+    // Print spaces for centering
+    writerPad(out, linePadding(options, displayWidth));
+
+    // Print the (already formatted) line
+    if (options->expandTabs)
+        writerAppendExpandingTabs(out, line, length, options->tabSize);
+    else
+        writerAppend(out, line, length);
+    writerPutChar(out, '\n');
+}
+
+/**
+ * Wraps a line to the width of the area, balanced if the options say so
+ *
+ * @return 0 on success, -1 on allocation failure.
+ */
+static inline int wrapLine(WrapBuffer *wrap, const LineSpan *line, const RenderOptions *options)
+{
+    return options->balance ? balanceTextToWidth(wrap, line->text, line->length, options->terminalWidth)
+                            : wrapTextToWidth(wrap, line->text, line->length, options->terminalWidth);
+}
+
+/**
+ * Prints a line of the input centered. With wrapping enabled, a line wider
+ * than the terminal is split into several lines that are centered one by one.
+ *
+ * @param out Writer to print to.
+ * @param line The line to print.
+ * @param options Layout settings.
+ * @param wrap Buffers for wrapping, reused across lines.
+ * @param blockWidth Width the padding is computed from, shared by all lines
+ *                   of a block; -1 to center each line by its own width.
+ */
+void renderLine(OutputWriter *out, const LineSpan *line, const RenderOptions *options, WrapBuffer *wrap,
+                int blockWidth)
+{
+    if (options->wrap && line->width > options->terminalWidth)
+    {
+        int wrapped = wrapLine(wrap, line, options);
+        if (wrapped < 0)
+        {
+            out->error = 1;
+            return;
+        }
+        if (wrap->lineCount > 0)
+        {
+            for (size_t i = 0; i < wrap->lineCount; i++)
+            {
+                const LineSpan *wrappedLine = &wrap->lines[i];
+                printCenteredLine(out, wrappedLine->text, wrappedLine->length,
+                                  blockWidth >= 0 ? blockWidth : wrappedLine->width, options);
+            }
+            return;
+        }
+        // Only whitespace: nothing to wrap, print the line as it is
+    }
+    printCenteredLine(out, line->text, line->length, blockWidth >= 0 ? blockWidth : line->width, options);
+}
+
+/**
+ * Returns the width of the widest row a line is printed as: with wrapping,
+ * a line wider than the area prints as the rows it is wrapped into.
+ *
+ * @param wrap Buffers for wrapping, reused across calls.
+ * @return The width, or -1 on allocation failure.
+ */
+int wrappedLineWidth(const LineSpan *line, const RenderOptions *options, WrapBuffer *wrap)
+{
+    if (!options->wrap || line->width <= options->terminalWidth)
+        return line->width;
+    int wrapped = wrapLine(wrap, line, options);
+    if (wrapped < 0)
+        return -1;
+    if (wrap->lineCount == 0)
+        return line->width; // Only whitespace: printed as it is
+    int width = 0;
+    for (size_t i = 0; i < wrap->lineCount; i++)
+    {
+        if (wrap->lines[i].width > width)
+            width = wrap->lines[i].width;
+    }
+    return width;
+}
+
+/**
+ * Works out the widths blocks are aligned by before a document is rendered:
+ * that of the whole document for BLOCK_DOCUMENT, and with wrapping, the
+ * widest row of each paragraph with lines wider than the area, since those
+ * are printed as their wrapped rows. Must be called again when the width of
+ * the area changes.
+ *
+ * @param layout Layout settings; receives the document's blockWidth.
+ * @param wrap Buffers for wrapping, reused across calls.
+ * @return 0 on success, -1 on allocation failure.
+ */
+int prepareBlockWidths(Document *doc, RenderOptions *layout, WrapBuffer *wrap)
+{
+    if (layout->block == BLOCK_NONE)
+        return 0;
+    int documentWidth = 0;
+    for (size_t i = 0; i < doc->paragraphCount; i++)
+    {
+        Paragraph *para = &doc->paragraphs[i];
+        int width = para->width;
+        if (layout->wrap && width > layout->terminalWidth)
+        {
+            width = 0;
+            for (size_t j = para->firstLine; j < para->firstLine + para->lineCount; j++)
+            {
+                int rowWidth = wrappedLineWidth(&doc->lines[j], layout, wrap);
+                if (rowWidth < 0)
+                    return -1;
+                if (rowWidth > width)
+                    width = rowWidth;
+            }
+        }
+        para->wrapWidth = width;
+        if (width > documentWidth)
+            documentWidth = width;
+    }
+    doc->wrapColumns = layout->wrap ? layout->terminalWidth : 0;
+    layout->blockWidth = documentWidth;
+    return 0;
+}
+
+/**
+ * Returns the width a line is aligned by when it is printed as part of
+ * the given paragraph. Paragraph widths are kept by the parser (and by
+ * prepareBlockWidths when wrapping), so render slices of a long paragraph
+ * do not measure it again.
+ */
+static int paragraphBlockWidth(const Document *doc, size_t para, const RenderOptions *options)
+{
+    if (options->block == BLOCK_DOCUMENT)
+        return options->blockWidth;
+    if (options->block != BLOCK_PARAGRAPH)
+        return -1;
+    const Paragraph *paragraph = &doc->paragraphs[para];
+    if (!options->wrap || paragraph->width <= options->terminalWidth)
+        return paragraph->width;
+    // Not prepared for this width: wrapped rows are at most as wide as the area
+    return doc->wrapColumns == options->terminalWidth ? paragraph->wrapWidth : options->terminalWidth;
+}
+
+/**
+ * Counts the rows of a terminal that many columns wide a printed row of
+ * the given width takes up, the terminal folding it if it is wider.
+ */
+static inline size_t terminalRows(long long printedWidth, int columns)
+{
+    if (columns <= 0 || printedWidth <= columns)
+        return 1;
+    return (size_t)((printedWidth + columns - 1) / columns);
+}
+
+/**
+ * Counts the terminal rows renderLine prints a line as: one per wrapped
+ * row, and more for a row wider than the terminal.
+ *
+ * @param blockWidth As for renderLine.
+ * @param columns Width of the terminal.
+ * @return The number of rows (at least 1), or 0 on allocation failure.
+ */
+size_t lineTerminalRows(const LineSpan *line, const RenderOptions *options, WrapBuffer *wrap, int blockWidth,
+                        int columns)
+{
+    if (options->wrap && line->width > options->terminalWidth)
+    {
+        int wrapped = wrapLine(wrap, line, options);
+        if (wrapped < 0)
+            return 0;
+        if (wrap->lineCount > 0)
+        {
+            size_t rows = 0;
+            for (size_t i = 0; i < wrap->lineCount; i++)
+            {
+                int width = wrap->lines[i].width;
+                int padding = linePadding(options, blockWidth >= 0 ? blockWidth : width);
+                rows += terminalRows((long long)padding + width, columns);
+            }
+            return rows;
+        }
+    }
+    int padding = linePadding(options, blockWidth >= 0 ? blockWidth : line->width);
+    return terminalRows((long long)padding + line->width, columns);
+}
+
+/**
+ * Prints a range of a document's lines centered, with a blank line before
+ * each paragraph except the first.
+ *
+ * @param out Writer to print to.
+ * @param doc The document.
+ * @param first Index of the first line to print.
+ * @param last Index after the last line to print.
+ * @param options Layout settings.
+ * @param wrap Buffers for wrapping, reused across calls.
+ */
+void renderLines(OutputWriter *out, const Document *doc, size_t first, size_t last,
+                 const RenderOptions *options, WrapBuffer *wrap)
+{
+    if (first >= last)
+        return;
+
+    // Find the paragraph that holds the line before the first one, so the
+    // blank lines before a paragraph starting at first are printed below
+    size_t previous = first > 0 ? first - 1 : 0;
+    size_t low = 0;
+    size_t high = doc->paragraphCount;
+    while (high - low > 1)
+    {
+        size_t mid = low + (high - low) / 2;
+        if (doc->paragraphs[mid].firstLine <= previous)
+            low = mid;
+        else
+            high = mid;
+    }
+    size_t para = low;
+    int blockWidth = paragraphBlockWidth(doc, para, options);
+
+    for (size_t i = first; i < last; i++)
+    {
+        // Print blank line between paragraphs
+        if (para + 1 < doc->paragraphCount && doc->paragraphs[para + 1].firstLine == i)
+        {
+            while (para + 1 < doc->paragraphCount && doc->paragraphs[para + 1].firstLine == i)
+            {
+                writerPutChar(out, '\n');
+                para++;
+            }
+            blockWidth = paragraphBlockWidth(doc, para, options);
+        }
+
+        renderLine(out, &doc->lines[i], options, wrap, blockWidth);
+    }
+}
+
+/**
+ * Buffer of one block of rendered lines in the parallel renderer
+ */
+typedef struct
+{
+    OutputWriter out; // Rendered output of the block
+    size_t block;     // Block held by the slot
+    int busy;         // The slot holds a block that has not been written yet
+    int ready;        // Rendering of the block is finished
+} RenderSlot;
+
+/**
+ * Shared state of the parallel renderer: workers render blocks of
+ * consecutive lines into slots, the writer emits the slots in block order.
+ */
+typedef struct
+{
+    const Document *doc;
+    const RenderOptions *options;
+    size_t blockCount; // Number of blocks of RENDER_BLOCK_LINES lines
+    size_t nextBlock;  // Next block to be claimed by a worker
+    int slotCount;     // Blocks that can be in flight at the same time
+    size_t written;    // Blocks the writer has emitted
+    RenderSlot slots[2 * MAX_RENDER_THREADS];
+    int failed; // Rendering or writing failed; everyone stops
+    pthread_mutex_t lock;
+    pthread_cond_t changed; // Signaled whenever a slot changes state
+} RenderPipeline;
+
+/**
+ * Thread function: renders blocks until all are claimed
+ */
+static void *renderWorker(void *arg)
+{
+    RenderPipeline *pipeline = (RenderPipeline *)arg;
+    WrapBuffer wrap;
+    memset(&wrap, 0, sizeof(wrap));
+    pthread_mutex_lock(&pipeline->lock);
+    while (!pipeline->failed && pipeline->nextBlock < pipeline->blockCount)
+    {
+        size_t block = pipeline->nextBlock++;
+        RenderSlot *slot = &pipeline->slots[block % pipeline->slotCount];
+
+        // Wait until the writer has emitted the block the slot held before.
+        // Waiting for the slot to be free is not enough: a worker holding a
+        // later block for the same slot could take it first and deadlock.
+        while (block >= pipeline->written + pipeline->slotCount && !pipeline->failed)
+        {
+            pthread_cond_wait(&pipeline->changed, &pipeline->lock);
+        }
+        if (pipeline->failed)
+            break;
+        slot->block = block;
+        slot->busy = 1;
+        slot->ready = 0;
+        pthread_mutex_unlock(&pipeline->lock);
+
+        size_t first = block * RENDER_BLOCK_LINES;
+        size_t last = first + RENDER_BLOCK_LINES;
+        if (last > pipeline->doc->lineCount)
+            last = pipeline->doc->lineCount;
+        slot->out.length = 0;
+        renderLines(&slot->out, pipeline->doc, first, last, pipeline->options, &wrap);
+
+        pthread_mutex_lock(&pipeline->lock);
+        if (slot->out.error)
+            pipeline->failed = 1;
+        slot->ready = 1;
+        pthread_cond_broadcast(&pipeline->changed);
+    }
+    pthread_mutex_unlock(&pipeline->lock);
+    freeWrapBuffer(&wrap);
+    return NULL;
+}
+
+/**
+ * Prints a document with several rendering threads. The calling thread is
+ * the single writer: it writes the rendered blocks to fd in order, while the
+ * workers format the following blocks.
+ *
+ * @param doc The document to print.
+ * @param fd File descriptor to write to.
+ * @param options Layout settings.
+ * @param threadCount Number of rendering threads (at most MAX_RENDER_THREADS).
+ * @return 0 on success, -1 on error.
+ */
+int printCenteredDocumentParallel(const Document *doc, int fd, const RenderOptions *options, int threadCount)
+{
+    RenderPipeline pipeline;
+    memset(&pipeline, 0, sizeof(pipeline));
+    pipeline.doc = doc;
+    pipeline.options = options;
+    pipeline.blockCount = (doc->lineCount + RENDER_BLOCK_LINES - 1) / RENDER_BLOCK_LINES;
+    pipeline.slotCount = 2 * threadCount;
+    pthread_mutex_init(&pipeline.lock, NULL);
+    pthread_cond_init(&pipeline.changed, NULL);
+
+    int result = 0;
+    int slotsReady = 0;
+    for (; slotsReady < pipeline.slotCount; slotsReady++)
+    {
+        if (initOutputWriter(&pipeline.slots[slotsReady].out, -1) < 0)
+        {
+            result = -1;
+            break;
+        }
+    }
+
+    pthread_t threads[MAX_RENDER_THREADS];
+    int started = 0;
+    for (; result == 0 && started < threadCount; started++)
+    {
+        if (pthread_create(&threads[started], NULL, renderWorker, &pipeline) != 0)
+        {
+            fprintf(stderr, "Error: Could not start render threads.\n");
+            result = -1;
+            break;
+        }
+    }
+    if (result < 0)
+    {
+        pthread_mutex_lock(&pipeline.lock);
+        pipeline.failed = 1;
+        pthread_cond_broadcast(&pipeline.changed);
+        pthread_mutex_unlock(&pipeline.lock);
+    }
+
+    // Write the blocks in order as they become ready
+    for (size_t block = 0; result == 0 && block < pipeline.blockCount; block++)
+    {
+        RenderSlot *slot = &pipeline.slots[block % pipeline.slotCount];
+
+        pthread_mutex_lock(&pipeline.lock);
+        while (!(slot->busy && slot->block == block && slot->ready) && !pipeline.failed)
+        {
+            pthread_cond_wait(&pipeline.changed, &pipeline.lock);
+        }
+        int failed = pipeline.failed;
+        pthread_mutex_unlock(&pipeline.lock);
+        if (failed)
+        {
+            result = -1;
+            break;
+        }
+
+        struct iovec iov = {slot->out.buffer, slot->out.length};
+        unsigned long long start = statsClock();
+        if (writeAll(fd, &iov, 1) < 0)
+        {
+            perror("Error writing output");
+            result = -1;
+        }
+        addStatTime(&stats.writeNanos, start);
+
+        pthread_mutex_lock(&pipeline.lock);
+        slot->busy = 0;
+        pipeline.written = block + 1;
+        if (result < 0)
+            pipeline.failed = 1;
+        pthread_cond_broadcast(&pipeline.changed);
+        pthread_mutex_unlock(&pipeline.lock);
+    }
+
+    for (int i = 0; i < started; i++)
+    {
+        pthread_join(threads[i], NULL);
+    }
+    for (int i = 0; i < slotsReady; i++)
+    {
+        freeOutputWriter(&pipeline.slots[i].out);
+    }
+    pthread_cond_destroy(&pipeline.changed);
+    pthread_mutex_destroy(&pipeline.lock);
+    return result;
+}
+
+/**
+ * Decides whether a document is formatted on all CPUs.
+ *
+ * @return Number of render threads, or 0 to render on the calling thread.
+ */
+static int renderThreadCount(const Document *doc)
+{
+    if (doc->lineCount < PARALLEL_RENDER_LINES)
+        return 0;
+    long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    int threads = cpus > MAX_RENDER_THREADS ? MAX_RENDER_THREADS : (int)cpus;
+    return threads > 1 ? threads : 0;
+}
+
+/**
+ * Prints all lines of a document through a writer in slices of
+ * RENDER_BLOCK_LINES, so lines after a terminal resize are centered at the
+ * new width.
+ *
+ * @param layout Layout settings, prepared by prepareBlockWidths; the width
+ *               is refreshed between slices.
+ * @param wrap Buffers for wrapping, reused across calls.
+ */
+void renderDocumentLines(OutputWriter *out, Document *doc, RenderOptions *layout, WrapBuffer *wrap)
+{
+    for (size_t first = 0; first < doc->lineCount; first += RENDER_BLOCK_LINES)
+    {
+        size_t last = doc->lineCount - first > RENDER_BLOCK_LINES ? first + RENDER_BLOCK_LINES : doc->lineCount;
+        if (refreshTerminalWidth(layout) && prepareBlockWidths(doc, layout, wrap) < 0)
+        {
+            out->error = 1;
+            return;
+        }
+        renderLines(out, doc, first, last, layout, wrap);
+    }
+}
+
+/**
+ * Prints a document centered on the terminal. Documents with at least
+ * PARALLEL_RENDER_LINES lines are formatted on all CPUs; from
+ * ASYNC_OUTPUT_LINES lines on, output is written in the background.
+ *
+ * @param doc The document to print.
+ * @param options Layout settings.
+ * @return 0 on success, -1 on error.
+ */
+int printCenteredDocument(Document *doc, const RenderOptions *options)
+{
+    if (!doc)
+        return -1;
+
+    // Block widths are taken from the cached line widths
+    RenderOptions layout = *options;
+    WrapBuffer wrap;
+    memset(&wrap, 0, sizeof(wrap));
+    if (prepareBlockWidths(doc, &layout, &wrap) < 0)
+    {
+        freeWrapBuffer(&wrap);
+        return -1;
+    }
+
+    int threads = renderThreadCount(doc);
+    if (threads > 0)
+    {
+        freeWrapBuffer(&wrap);
+        return printCenteredDocumentParallel(doc, STDOUT_FILENO, &layout, threads);
+    }
+
+    OutputWriter out;
+    if (initOutputWriter(&out, STDOUT_FILENO) < 0)
+    {
+        freeWrapBuffer(&wrap);
+        return -1;
+    }
+
+    // Pass full buffers to a pipe without copying, or write each full buffer
+    // in the background while the next one is formatted
+    AsyncIo io;
+    int spliced = setOutputWriterSplice(&out);
+    if (spliced < 0)
+    {
+        freeOutputWriter(&out);
+        freeWrapBuffer(&wrap);
+        return -1;
+    }
+    int async = !spliced && doc->lineCount >= ASYNC_OUTPUT_LINES;
+    if (async)
+    {
+        initAsyncIo(&io, 1);
+        if (setOutputWriterAsync(&out, &io) < 0)
+        {
+            freeOutputWriter(&out);
+            freeAsyncIo(&io);
+            freeWrapBuffer(&wrap);
+            return -1;
+        }
+    }
+
+    renderDocumentLines(&out, doc, &layout, &wrap);
+    freeWrapBuffer(&wrap);
+
+    int result = freeOutputWriter(&out);
+    if (async)
+        freeAsyncIo(&io);
+    return result;
+}
+
+/**
+ * Finds the first line of the last screen of a document: the lines from
+ * there on, with their blank lines and wrapped or folded rows, fill the
+ * terminal except for its last row, which stays below the cursor. The
+ * last line is always included.
+ *
+ * @param layout Layout settings, prepared by prepareBlockWidths.
+ * @param first Receives the index of the first line.
+ * @return 0 on success, -1 on allocation failure.
+ */
+static int followStart(const Document *doc, const RenderOptions *layout, WrapBuffer *wrap, size_t *first)
+{
+    size_t screen = (size_t)getTerminalHeight() - 1;
+    int columns = getTerminalWidth();
+    size_t used = 0;
+    size_t para = doc->paragraphCount;
+    size_t i = doc->lineCount;
+    while (i > 0)
+    {
+        size_t line = i - 1;
+        while (para > 0 && doc->paragraphs[para - 1].firstLine > line)
+        {
+            para--;
+        }
+        size_t rows = lineTerminalRows(&doc->lines[line], layout, wrap, paragraphBlockWidth(doc, para - 1, layout),
+                                       columns);
+        if (rows == 0)
+            return -1;
+        // Blank lines renderLines prints above a paragraph starting here
+        for (size_t p = para - 1; p > 0 && doc->paragraphs[p].firstLine == line; p--)
+        {
+            rows++;
+        }
+        if (used + rows > screen && i < doc->lineCount)
+            break;
+        used += rows;
+        i--;
+    }
+    *first = i;
+    return 0;
+}
+
+/**
+ * Prints a document centered and then redraws its last screen of lines on
+ * every terminal resize until the process is interrupted. A redraw reuses
+ * the parsed lines and their cached widths; only the padding is redone.
+ *
+ * @param doc The document to print.
+ * @param options Layout settings.
+ * @return -1 on error; only returns 0 if waiting for a resize fails.
+ */
+int followDocument(Document *doc, const RenderOptions *options)
+{
+    sig_atomic_t seenResizes = terminalResizeCount;
+    if (printCenteredDocument(doc, options) < 0)
+        return -1;
+
+    RenderOptions layout = *options;
+    WrapBuffer wrap;
+    memset(&wrap, 0, sizeof(wrap));
+    int result = 0;
+    while (waitForInputOrResize(-1, seenResizes))
+    {
+        seenResizes = terminalResizeCount;
+        refreshTerminalWidth(&layout);
+        if (prepareBlockWidths(doc, &layout, &wrap) < 0)
+        {
+            result = -1;
+            break;
+        }
+
+        OutputWriter out;
+        if (initOutputWriter(&out, STDOUT_FILENO) < 0)
+        {
+            result = -1;
+            break;
+        }
+        size_t first;
+        if (followStart(doc, &layout, &wrap, &first) < 0)
+        {
+            freeOutputWriter(&out);
+            result = -1;
+            break;
+        }
+        writerAppend(&out, CLEAR_SCREEN, strlen(CLEAR_SCREEN));
+        renderLines(&out, doc, first, doc->lineCount, &layout, &wrap);
+        if (freeOutputWriter(&out) < 0)
+        {
+            result = -1;
+            break;
+        }
+    }
+    freeWrapBuffer(&wrap);
+    return result;
+}
+
+/**
+ * Reads the content of a file into a dynamically allocated string.
+ *
+ * @param filename Path to the file to be read.
+ * @param length Receives the number of bytes read.
+ * @return Dynamically allocated string with the file content, or NULL on error.
+ */
+char *readFileToString(const char *filename, size_t *length)
+{
+    FILE *file = fopen(filename, "r");
+    if (file == NULL)
+    {
+        perror("Error opening file");
+        return NULL;
+    }
+
+    fseek(file, 0, SEEK_END);
+    long fileSize = ftell(file);
+    if (fileSize < 0)
     { // Error checking for ftell
         perror("Error determining file size");
         fclose(file);
         return NULL;
     }
-    fseek(file, 0, SEEK_SET);
+    fseek(file, 0, SEEK_SET);
+
+    char *buffer = (char *)malloc(fileSize + 1);
+    if (buffer == NULL)
+    {
+        perror("Memory allocation error for file content buffer");
+        fclose(file);
+        return NULL;
+    }
+
+    size_t bytesRead = fread(buffer, 1, fileSize, file);
+    if (bytesRead < (size_t)fileSize && ferror(file))
+    {
+        perror("Error reading file");
+        fclose(file);
+        free(buffer);
+        return NULL;
+    }
+    buffer[bytesRead] = '\0'; // Null-terminate string
+    *length = bytesRead;
+
+    fclose(file);
+    return buffer;
+}
+
+/**
+ * Maps a regular file read-only, followed by an anonymous zero page that
+ * provides the terminating null byte without touching the file.
+ *
+ * @param fd The open file, mapped from its start.
+ * @param fileSize Size of the file.
+ * @param mappedLength Receives the size of the mapping.
+ * @return The mapped content, or NULL if the file cannot be mapped.
+ */
+static char *mapFdToString(int fd, size_t fileSize, size_t *mappedLength)
+{
+    size_t pageSize = (size_t)sysconf(_SC_PAGESIZE);
+    size_t mapLength = (fileSize + pageSize - 1) / pageSize * pageSize + pageSize;
+
+    // Reserve zero-filled memory, then map the file over its beginning
+    char *base = (char *)mmap(NULL, mapLength, PROT_READ, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (base == MAP_FAILED)
+        return NULL;
+    if (mmap(base, fileSize, PROT_READ, MAP_PRIVATE | MAP_FIXED, fd, 0) == MAP_FAILED)
+    {
+        munmap(base, mapLength);
+        return NULL;
+    }
+    madvise(base, fileSize, MADV_SEQUENTIAL);
+    *mappedLength = mapLength;
+    return base;
+}
+
+/**
+ * Makes the content of a file available as a null-terminated string.
+ * Large regular files are memory-mapped read-only instead of copied; the
+ * mapping is followed by an anonymous zero page, which provides the
+ * terminating null byte without touching the file. Pipes, special files
+ * and small files fall back to readFileToString.
+ *
+ * @param filename Path to the file to be read.
+ * @param mappedLength Receives the size of the mapping, or 0 if the returned
+ *                     string was allocated with malloc.
+ * @param length Receives the size of the file content.
+ * @return String with the file content (release with freeFileContent), or NULL on error.
+ */
+char *mapFileToString(const char *filename, size_t *mappedLength, size_t *length)
+{
+    *mappedLength = 0;
+
+    int fd = open(filename, O_RDONLY);
+    if (fd == -1)
+    {
+        perror("Error opening file");
+        return NULL;
+    }
+
+    struct stat st;
+    if (fstat(fd, &st) == -1 || !S_ISREG(st.st_mode) || st.st_size < MMAP_THRESHOLD)
+    {
+        close(fd);
+        return readFileToString(filename, length);
+    }
+
+    char *base = mapFdToString(fd, (size_t)st.st_size, mappedLength);
+    close(fd); // The mapping stays valid
+    if (!base)
+        return readFileToString(filename, length);
+    *length = (size_t)st.st_size;
+    return base;
+}
+
+/**
+ * Releases a string returned by mapFileToString or readStdinToString.
+ *
+ * @param content The file content.
+ * @param mappedLength Size of the mapping as returned by mapFileToString.
+ */
+void freeFileContent(char *content, size_t mappedLength)
+{
+    if (mappedLength > 0)
+    {
+        munmap(content, mappedLength);
+    }
+    else
+    {
+        free(content);
+    }
+}
+
+/**
+ * Reads the entire content of standard input into a null-terminated
+ * string. A regular file of at least MMAP_THRESHOLD bytes that is read
+ * from its start is memory-mapped like with mapFileToString. Anything else
+ * is read with read(2) straight into an anonymous mapping, sized from the
+ * rest of the file when it is one. The mapping grows with mremap, which
+ * moves pages instead of copying bytes, and untouched pages cost no memory.
+ * main streams pipes and terminals (see centerStream), so only
+ * tools/bench.c reads them here; their size is not known in advance
+ * (FIONREAD would only tell what the pipe holds, less than
+ * STDIN_BUFFER_SIZE), so they start at STDIN_BUFFER_SIZE and grow.
+ *
+ * @param mappedLength Receives the size of the mapping.
+ * @param length Receives the number of bytes read.
+ * @return String with the content from stdin (release with freeFileContent), or NULL on error.
+ */
+char *readStdinToString(size_t *mappedLength, size_t *length)
+{
+    size_t pageSize = (size_t)sysconf(_SC_PAGESIZE);
+    size_t hint = 0; // Expected size of the input
+    struct stat st;
+    if (fstat(STDIN_FILENO, &st) == 0 && S_ISREG(st.st_mode))
+    {
+        off_t offset = lseek(STDIN_FILENO, 0, SEEK_CUR);
+        if (offset == 0 && st.st_size >= MMAP_THRESHOLD)
+        {
+            char *base = mapFdToString(STDIN_FILENO, (size_t)st.st_size, mappedLength);
+            if (base)
+            {
+                *length = (size_t)st.st_size;
+                return base;
+            }
+        }
+        if (offset >= 0 && st.st_size > offset)
+            hint = (size_t)(st.st_size - offset);
+    }
+
+    // Room for the hinted size plus the null byte, at least STDIN_BUFFER_SIZE
+    size_t capacity = hint + 1 > STDIN_BUFFER_SIZE ? hint + 1 : STDIN_BUFFER_SIZE;
+    capacity = (capacity + pageSize - 1) / pageSize * pageSize;
+    char *buffer = (char *)mmap(NULL, capacity, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (buffer == MAP_FAILED)
+    {
+        perror("Memory allocation error for stdin buffer");
+        return NULL;
+    }
+
+    size_t size = 0;
+    for (;;)
+    {
+        if (capacity - size <= 1)
+        {
+            // Full (only space left for the null byte): double the mapping
+            char *newBuffer = (char *)mremap(buffer, capacity, 2 * capacity, MREMAP_MAYMOVE);
+            if (newBuffer == MAP_FAILED)
+            {
+                perror("Memory reallocation error for stdin buffer");
+                munmap(buffer, capacity);
+                return NULL;
+            }
+            buffer = newBuffer;
+            capacity *= 2;
+        }
+        ssize_t bytesRead = read(STDIN_FILENO, buffer + size, capacity - size - 1);
+        if (bytesRead < 0)
+        {
+            if (errno == EINTR)
+                continue;
+            perror("Error reading from stdin");
+            munmap(buffer, capacity);
+            return NULL;
+        }
+        if (bytesRead == 0)
+            break; // EOF
+        size += bytesRead;
+    }
+
+    // The byte after the content is still zero from the anonymous mapping
+    *mappedLength = capacity;
+    *length = size;
+    return buffer;
+}
+
+/**
+ * One file of a multi-file run, loaded and parsed by a pool thread
+ */
+typedef struct
+{
+    const char *filename; // Path given on the command line
+    char *content;        // Content of the file, NULL if it could not be read
+    size_t mappedLength;  // Mapping size for freeFileContent
+    Document *doc;        // Parsed content, NULL on error
+    int ready;            // Loading has finished, successfully or not
+} FileJob;
+
+/**
+ * Shared state of the file pool: workers load and parse files in argument
+ * order, the calling thread prints them in the same order.
+ */
+typedef struct
+{
+    FileJob *jobs;
+    size_t jobCount;
+    size_t nextJob;  // Next file to be claimed by a worker
+    size_t printed;  // Files the printer is done with
+    size_t inFlight; // Files that may be loaded ahead of the printer
+    int tabSize;     // Columns between tab stops, for the line widths
+    int lineCache;   // Each worker remembers the widths of repeated lines
+    int stopping;    // Printing failed; workers stop claiming files
+    pthread_mutex_t lock;
+    pthread_cond_t changed; // Signaled whenever a file is loaded or printed
+} FilePool;
+
+/**
+ * Thread function: loads and parses files until all are claimed, staying
+ * at most inFlight files ahead of the printer
+ */
+static void *fileWorker(void *arg)
+{
+    FilePool *pool = (FilePool *)arg;
+    LineCache *cache = pool->lineCache ? createLineCache() : NULL; // Shared by the worker's files
+    pthread_mutex_lock(&pool->lock);
+    while (!pool->stopping && pool->nextJob < pool->jobCount)
+    {
+        if (pool->nextJob >= pool->printed + pool->inFlight)
+        {
+            pthread_cond_wait(&pool->changed, &pool->lock);
+            continue;
+        }
+        FileJob *job = &pool->jobs[pool->nextJob++];
+        pthread_mutex_unlock(&pool->lock);
+
+        size_t length;
+        unsigned long long start = statsClock();
+        job->content = mapFileToString(job->filename, &job->mappedLength, &length);
+        addStatTime(&stats.readNanos, start);
+        if (job->content)
+        {
+            addStat(&stats.bytesIn, length);
+            start = statsClock();
+            job->doc = parseDocument(job->content, length, pool->tabSize, cache);
+            addStatTime(&stats.parseNanos, start);
+        }
+
+        pthread_mutex_lock(&pool->lock);
+        job->ready = 1;
+        pthread_cond_broadcast(&pool->changed);
+    }
+    pthread_mutex_unlock(&pool->lock);
+    freeLineCache(cache);
+    return NULL;
+}
+
+/**
+ * Prints a "==> name <==" line above the lines of a file, aligned like them
+ */
+static void printFileHeader(OutputWriter *out, const char *filename, const RenderOptions *options)
+{
+    size_t length = strlen(filename);
+    int width = getDisplayWidth(filename, length, options->tabSize) + 8; // "==> " and " <=="
+    writerPad(out, linePadding(options, width));
+    writerAppend(out, "==> ", 4);
+    writerAppend(out, filename, length);
+    writerAppend(out, " <==\n", 5);
+}
+
+/**
+ * Centers several files, one after the other in argument order, with a
+ * blank line between them. A pool of threads reads and parses the next
+ * files while the current one is printed. Files that cannot be read are
+ * reported and skipped.
+ *
+ * @param filenames Paths of the files.
+ * @param count Number of files.
+ * @param options Layout settings; options->header adds a line with the
+ *                name above each file.
+ * @return 0 on success, -1 if a file was skipped or output failed.
+ */
+int centerFiles(char *const *filenames, size_t count, const RenderOptions *options)
+{
+    FilePool pool;
+    memset(&pool, 0, sizeof(pool));
+    pool.jobs = (FileJob *)calloc(count, sizeof(FileJob));
+    if (!pool.jobs)
+    {
+        perror("Memory allocation error for file list");
+        return -1;
+    }
+    for (size_t i = 0; i < count; i++)
+    {
+        pool.jobs[i].filename = filenames[i];
+    }
+    pool.jobCount = count;
+    pool.tabSize = options->tabSize;
+    pool.lineCache = options->lineCache;
+
+    long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    int threadCount = cpus < 1 ? 1 : cpus > MAX_FILE_THREADS ? MAX_FILE_THREADS : (int)cpus;
+    if ((size_t)threadCount > count)
+        threadCount = (int)count;
+    pool.inFlight = 2 * (size_t)threadCount;
+
+    OutputWriter out;
+    if (initOutputWriter(&out, STDOUT_FILENO) < 0)
+    {
+        free(pool.jobs);
+        return -1;
+    }
+    if (setOutputWriterSplice(&out) < 0)
+    {
+        freeOutputWriter(&out);
+        free(pool.jobs);
+        return -1;
+    }
+    pthread_mutex_init(&pool.lock, NULL);
+    pthread_cond_init(&pool.changed, NULL);
+
+    pthread_t threads[MAX_FILE_THREADS];
+    int started = 0;
+    for (; started < threadCount; started++)
+    {
+        if (pthread_create(&threads[started], NULL, fileWorker, &pool) != 0)
+            break;
+    }
+    if (started == 0)
+    {
+        // No threads: load everything up front, in order
+        pool.inFlight = count;
+        fileWorker(&pool);
+    }
+
+    int result = 0;
+    int printedAny = 0;
+    RenderOptions layout = *options;
+    WrapBuffer wrap;
+    memset(&wrap, 0, sizeof(wrap));
+    size_t next = 0;
+    for (; next < count && !out.error; next++)
+    {
+        FileJob *job = &pool.jobs[next];
+        pthread_mutex_lock(&pool.lock);
+        while (!job->ready)
+        {
+            pthread_cond_wait(&pool.changed, &pool.lock);
+        }
+        pthread_mutex_unlock(&pool.lock);
+
+        if (!job->doc)
+        {
+            fprintf(stderr, "Error: Skipping '%s'.\n", job->filename);
+            result = -1;
+        }
+        else if (options->header || job->doc->lineCount > 0)
+        {
+            unsigned long long start = statsClock();
+            addStat(&stats.lines, job->doc->lineCount);
+            addStat(&stats.paragraphs, job->doc->paragraphCount);
+            refreshTerminalWidth(&layout);
+            if (printedAny)
+                writerPutChar(&out, '\n');
+            if (options->header)
+                printFileHeader(&out, job->filename, &layout);
+            printedAny = 1;
+
+            // Every file goes through this writer: a second one on the same
+            // pipe would splice buffers this one does not know about
+            if (prepareBlockWidths(job->doc, &layout, &wrap) < 0)
+                out.error = 1;
+            int renderThreads = renderThreadCount(job->doc);
+            if (renderThreads > 0)
+            {
+                // Large file: formatted on all CPUs and written (copied) after what is buffered
+                if (flushOutputWriter(&out) < 0 ||
+                    printCenteredDocumentParallel(job->doc, out.fd, &layout, renderThreads) < 0)
+                    out.error = 1;
+            }
+            else
+                renderDocumentLines(&out, job->doc, &layout, &wrap);
+            addStatTime(&stats.outputNanos, start);
+        }
+
+        if (job->doc)
+            freeDocument(job->doc);
+        if (job->content)
+            freeFileContent(job->content, job->mappedLength);
+        job->doc = NULL;
+        job->content = NULL;
+
+        pthread_mutex_lock(&pool.lock);
+        pool.printed = next + 1;
+        pthread_cond_broadcast(&pool.changed);
+        pthread_mutex_unlock(&pool.lock);
+    }
+
+    // Stop the workers, then release what they loaded past a write error
+    pthread_mutex_lock(&pool.lock);
+    pool.stopping = 1;
+    pthread_cond_broadcast(&pool.changed);
+    pthread_mutex_unlock(&pool.lock);
+    for (int i = 0; i < started; i++)
+    {
+        pthread_join(threads[i], NULL);
+    }
+    for (; next < count; next++)
+    {
+        if (pool.jobs[next].doc)
+            freeDocument(pool.jobs[next].doc);
+        if (pool.jobs[next].content)
+            freeFileContent(pool.jobs[next].content, pool.jobs[next].mappedLength);
+    }
+
+    freeWrapBuffer(&wrap);
+    unsigned long long start = statsClock();
+    if (freeOutputWriter(&out) < 0)
+        result = -1;
+    addStatTime(&stats.outputNanos, start);
+    pthread_cond_destroy(&pool.changed);
+    pthread_mutex_destroy(&pool.lock);
+    free(pool.jobs);
+    return result;
+}
+
+/**
+ * A line held back in streaming block mode; length 0 marks a paragraph break
+ */
+typedef struct
+{
+    size_t offset; // Start of the line in the window buffer
+    size_t length; // Length of the line in bytes
+    int width;     // Display width of the line
+} StreamWindowLine;
+
+/**
+ * Copy of a printed line of a stream, kept to redraw the screen
+ */
+typedef struct
+{
+    char *text;      // Text of the line (not null-terminated)
+    size_t length;   // Length of the line in bytes
+    size_t capacity; // Capacity of text, reused for later lines
+    int width;       // Display width of the line
+    int blockWidth;  // Width the line was aligned by, -1 for its own
+    int breakBefore; // A blank line was printed before the line
+} FollowLine;
+
+/**
+ * State carried between chunks while centering a stream
+ */
+typedef struct
+{
+    char *carry;                   // Start of a line that continues in the next chunk
+    size_t carryLength;            // Number of bytes in carry
+    size_t carryCapacity;          // Capacity of the carry buffer
+    size_t carryCheck;             // Carry length at which it is next checked for pass-through
+    int passThrough;               // The current line is wider than the area and printed as it arrives
+    RenderOptions layout;          // Layout settings; the width follows terminal resizes
+    char *window;                  // Text of the lines held back for block alignment
+    size_t windowLength;           // Number of bytes in window
+    size_t windowCapacity;         // Capacity of the window buffer
+    StreamWindowLine *windowLines; // Lines held back, in order
+    size_t windowLineCount;        // Number of lines held back
+    int blockWidth;                // Widest line (or wrapped row) of the current block so far
+    WrapBuffer wrap;               // Buffers for wrapping wide lines
+    OutputWriter out;              // Destination of the centered lines
+    int pendingBreak;              // An empty line was seen since the last printed line
+    int printedAny;                // At least one line has been printed
+    FollowLine *history;           // Ring of the last lines printed, NULL without --follow
+    size_t historyCount;           // Number of lines in history
+    size_t historyNext;            // Slot the next printed line goes to
+    LineCache *cache;              // Widths of lines seen before, NULL without --line-cache
+} StreamState;
+
+/**
+ * Appends bytes to the carry buffer of a stream.
+ *
+ * @return 0 on success, -1 on allocation failure.
+ */
+int appendToCarry(StreamState *state, const char *data, size_t length)
+{
+    if (length == 0)
+        return 0;
+    if (state->carryLength + length > state->carryCapacity)
+    {
+        size_t newCapacity = state->carryCapacity ? state->carryCapacity : 256;
+        while (newCapacity < state->carryLength + length)
+        {
+            newCapacity *= 2;
+        }
+        char *newCarry = (char *)realloc(state->carry, newCapacity);
+        if (!newCarry)
+        {
+            perror("Reallocation error for stream carry buffer");
+            return -1;
+        }
+        state->carry = newCarry;
+        state->carryCapacity = newCapacity;
+    }
+    memcpy(state->carry + state->carryLength, data, length);
+    state->carryLength += length;
+    return 0;
+}
+
+/**
+ * Remembers a printed line of a stream for redrawing, replacing the oldest
+ * one once the history is full. Entries keep their buffers, so a full
+ * history allocates only for lines longer than any before in their slot.
+ *
+ * @return 0 on success, -1 on allocation failure.
+ */
+static int rememberStreamLine(StreamState *state, const char *line, size_t length, int width, int blockWidth,
+                              int breakBefore)
+{
+    FollowLine *entry = &state->history[state->historyNext];
+    if (length > entry->capacity)
+    {
+        char *text = (char *)realloc(entry->text, length);
+        if (!text)
+        {
+            perror("Reallocation error for follow history");
+            return -1;
+        }
+        entry->text = text;
+        entry->capacity = length;
+    }
+    memcpy(entry->text, line, length);
+    entry->length = length;
+    entry->width = width;
+    entry->blockWidth = blockWidth;
+    entry->breakBefore = breakBefore;
+    state->historyNext = (state->historyNext + 1) % FOLLOW_HISTORY_LINES;
+    if (state->historyCount < FOLLOW_HISTORY_LINES)
+        state->historyCount++;
+    return 0;
+}
+
+/**
+ * Prints one complete line of a stream. Empty lines separate paragraphs,
+ * exactly as "\n\n" does in parseDocument, so the output matches the
+ * batch path.
+ *
+ * @param line The line without its newline (not null-terminated).
+ * @param length Length of the line in bytes.
+ * @param width Display width of the line.
+ * @param blockWidth Width the padding is computed from, -1 for the line's own.
+ */
+static void emitStreamLine(StreamState *state, const char *line, size_t length, int width, int blockWidth)
+{
+    if (length == 0)
+    {
+        // Paragraph boundary; only printed once the next paragraph starts
+        state->pendingBreak = state->printedAny;
+        return;
+    }
+
+    int breakBefore = state->pendingBreak;
+    if (state->pendingBreak)
+    {
+        writerPutChar(&state->out, '\n');
+        state->pendingBreak = 0;
+    }
+    addStat(&stats.paragraphs, !state->printedAny || breakBefore);
+    addStat(&stats.lines, 1);
+    LineSpan span = {line, length, width};
+    renderLine(&state->out, &span, &state->layout, &state->wrap, blockWidth);
+    state->printedAny = 1;
+    if (state->history && rememberStreamLine(state, line, length, width, blockWidth, breakBefore) < 0)
+        state->out.error = 1;
+}
+
+/**
+ * Clears the terminal and prints the remembered lines that fit on it again
+ * at the current width, counting the rows they are wrapped or folded into
+ * at that width. Only the padding (and wrapping) is redone; the widths come
+ * from the history.
+ */
+void redrawStreamHistory(StreamState *state)
+{
+    // Take lines from the newest back while their rows fill the terminal
+    // except for its last row, which stays below the cursor
+    size_t screen = (size_t)getTerminalHeight() - 1;
+    int columns = getTerminalWidth();
+    size_t used = 0;
+    size_t count = 0;
+    int breakBelow = 0; // The line below the next older one has a blank line above it
+    while (count < state->historyCount)
+    {
+        const FollowLine *entry =
+            &state->history[(state->historyNext + FOLLOW_HISTORY_LINES - count - 1) % FOLLOW_HISTORY_LINES];
+        LineSpan span = {entry->text, entry->length, entry->width};
+        size_t rows = lineTerminalRows(&span, &state->layout, &state->wrap, entry->blockWidth, columns);
+        if (rows == 0)
+        {
+            state->out.error = 1;
+            return;
+        }
+        rows += breakBelow;
+        if (used + rows > screen && count > 0)
+            break;
+        used += rows;
+        count++;
+        breakBelow = entry->breakBefore;
+    }
+    size_t index = (state->historyNext + FOLLOW_HISTORY_LINES - count) % FOLLOW_HISTORY_LINES;
+
+    writerAppend(&state->out, CLEAR_SCREEN, strlen(CLEAR_SCREEN));
+    for (size_t i = 0; i < count; i++)
+    {
+        const FollowLine *entry = &state->history[index];
+        if (entry->breakBefore && i > 0)
+            writerPutChar(&state->out, '\n');
+        LineSpan span = {entry->text, entry->length, entry->width};
+        renderLine(&state->out, &span, &state->layout, &state->wrap, entry->blockWidth);
+        index = (index + 1) % FOLLOW_HISTORY_LINES;
+    }
+}
+
+/**
+ * Prints the lines held back for block alignment, all aligned by the
+ * widest line of the block seen so far.
+ */
+void flushStreamWindow(StreamState *state)
+{
+    for (size_t i = 0; i < state->windowLineCount; i++)
+    {
+        const StreamWindowLine *line = &state->windowLines[i];
+        emitStreamLine(state, state->window + line->offset, line->length, line->width, state->blockWidth);
+    }
+    state->windowLineCount = 0;
+    state->windowLength = 0;
+}
+
+/**
+ * Holds a line back until the width of its block is known.
+ *
+ * @return 0 on success, -1 on allocation failure.
+ */
+int appendToWindow(StreamState *state, const char *line, size_t length, int width)
+{
+    if (!state->windowLines)
+    {
+        state->windowLines = (StreamWindowLine *)malloc(STREAM_WINDOW_LINES * sizeof(StreamWindowLine));
+        if (!state->windowLines)
+        {
+            perror("Memory allocation error for stream window");
+            return -1;
+        }
+    }
+    if (state->windowLength + length > state->windowCapacity)
+    {
+        size_t newCapacity = state->windowCapacity ? state->windowCapacity : 4096;
+        while (newCapacity < state->windowLength + length)
+        {
+            newCapacity *= 2;
+        }
+        char *newWindow = (char *)realloc(state->window, newCapacity);
+        if (!newWindow)
+        {
+            perror("Reallocation error for stream window");
+            return -1;
+        }
+        state->window = newWindow;
+        state->windowCapacity = newCapacity;
+    }
+
+    StreamWindowLine *entry = &state->windowLines[state->windowLineCount++];
+    entry->offset = state->windowLength;
+    entry->length = length;
+    entry->width = width;
+    if (length > 0)
+        memcpy(state->window + state->windowLength, line, length);
+    state->windowLength += length;
+    return 0;
+}
+
+/**
+ * Handles one complete line of a stream. In block mode lines are held back
+ * in a bounded window until their paragraph (or the document) ends, so the
+ * block can share one padding and is laid out as in the batch path. A block
+ * larger than the window is aligned by the widest line seen when the window
+ * fills, and on a terminal one is also shown once the input pauses for
+ * STREAM_PAUSE_MS, see centerStream.
+ *
+ * @param line The line without its newline (not null-terminated).
+ * @param length Length of the line in bytes.
+ * @param width Display width of the line.
+ * @return 0 on success, -1 on allocation failure.
+ */
+int streamLine(StreamState *state, const char *line, size_t length, int width)
+{
+    refreshTerminalWidth(&state->layout);
+    int block = state->layout.block;
+    if (block == BLOCK_NONE)
+    {
+        emitStreamLine(state, line, length, width, -1);
+        return 0;
+    }
+
+    if (length == 0 && (block == BLOCK_PARAGRAPH || state->windowLineCount == 0))
+    {
+        // End of a paragraph: its width is known now
+        flushStreamWindow(state);
+        if (block == BLOCK_PARAGRAPH)
+            state->blockWidth = 0;
+        emitStreamLine(state, line, length, width, -1);
+        return 0;
+    }
+
+    if (appendToWindow(state, line, length, width) < 0)
+        return -1;
+    LineSpan span = {line, length, width};
+    int rowWidth = wrappedLineWidth(&span, &state->layout, &state->wrap);
+    if (rowWidth < 0)
+        return -1;
+    if (rowWidth > state->blockWidth)
+        state->blockWidth = rowWidth;
+    if (state->windowLineCount == STREAM_WINDOW_LINES || state->windowLength >= STREAM_WINDOW_SIZE)
+        flushStreamWindow(state);
+    return 0;
+}
+
+/**
+ * Checks whether the unfinished line in the carry buffer is already wider
+ * than the area, and if so prints it and switches to passing the rest of
+ * the line through as it arrives. Such a line is never measured past this
+ * point, since its padding cannot change any more, and it holds no memory
+ * however long it gets. Wrapping, tab expansion and follow mode need the
+ * whole line, so they keep carrying it.
+ */
+static void checkPassThrough(StreamState *state)
+{
+    const RenderOptions *layout = &state->layout;
+    if (state->carryLength < STREAM_LONG_LINE || state->carryLength < state->carryCheck || layout->wrap ||
+        layout->expandTabs || state->history)
+        return;
+    int width = getDisplayWidth(state->carry, state->carryLength, layout->tabSize);
+    if (width < layout->terminalWidth)
+    {
+        state->carryCheck = 2 * state->carryLength; // Mostly escape sequences; look again later
+        return;
+    }
+
+    if (layout->block != BLOCK_NONE)
+    {
+        // The rest of the block is aligned by a line at least as wide as the area
+        state->blockWidth = INT_MAX;
+        flushStreamWindow(state);
+    }
+    if (state->pendingBreak)
+    {
+        writerPutChar(&state->out, '\n');
+        state->pendingBreak = 0;
+        addStat(&stats.paragraphs, 1);
+    }
+    else
+        addStat(&stats.paragraphs, !state->printedAny);
+    addStat(&stats.lines, 1);
+    writerPad(&state->out, linePadding(layout, width));
+    writerAppend(&state->out, state->carry, state->carryLength);
+    state->printedAny = 1;
+    state->carryLength = 0;
+    state->carryCheck = 0;
+    state->passThrough = 1;
+}
+
+/**
+ * Redraws the screen of a followed stream on every terminal resize until
+ * input arrives.
+ *
+ * @param fd File descriptor the input comes from, -1 to wait for resizes only.
+ * @param seenResizes Resizes handled so far, updated.
+ * @return 0 once input is ready (with fd -1 only if waiting fails), -1 on write errors.
+ */
+static int followResizes(StreamState *state, int fd, sig_atomic_t *seenResizes)
+{
+    while (waitForInputOrResize(fd, *seenResizes))
+    {
+        *seenResizes = terminalResizeCount;
+        refreshTerminalWidth(&state->layout);
+        redrawStreamHistory(state);
+        if (flushOutputWriter(&state->out) < 0)
+            return -1;
+    }
+    return 0;
+}
+
+/**
+ * Centers the content of a file descriptor line by line while it is read.
+ * Only two chunks plus the current unfinished line are held in memory.
+ * Output is flushed whenever the next chunk has not arrived yet, so lines
+ * show up as soon as the input pauses (e.g. from `tail -f`), while a fast
+ * producer gets full output buffers. Lines held back for block alignment
+ * are only shown early on a terminal (or with options->follow), after the
+ * input has paused for STREAM_PAUSE_MS. Like the batch path, input ends at
+ * the first null byte. A line found to be wider than the area while it is
+ * still being read is passed through in pieces, see checkPassThrough.
+ * Lines after a terminal resize are centered at the
+ * new width; with options->follow, the screen is also redrawn from the
+ * last lines printed, and after the end of the input the function keeps
+ * doing so until the process is interrupted.
+ *
+ * @param fd File descriptor to read from.
+ * @param options Layout settings.
+ * @return 0 on success, -1 on error.
+ */
+int centerStream(int fd, const RenderOptions *options)
+{
+    // Two chunks: one is centered while the next one is read into the other
+    char *chunks = (char *)malloc(2 * STREAM_CHUNK_SIZE);
+    if (!chunks)
+    {
+        perror("Memory allocation error for stream chunk");
+        return -1;
+    }
+
+    StreamState state;
+    memset(&state, 0, sizeof(state));
+    state.layout = *options;
+    if (options->lineCache && !(state.cache = createLineCache()))
+    {
+        free(chunks);
+        return -1;
+    }
+    if (options->follow)
+    {
+        state.history = (FollowLine *)calloc(FOLLOW_HISTORY_LINES, sizeof(FollowLine));
+        if (!state.history)
+        {
+            perror("Memory allocation error for follow history");
+            freeLineCache(state.cache);
+            free(chunks);
+            return -1;
+        }
+    }
+    if (initOutputWriter(&state.out, STDOUT_FILENO) < 0)
+    {
+        free(state.history);
+        freeLineCache(state.cache);
+        free(chunks);
+        return -1;
+    }
+    // Following waits for input and resizes together, so SIGWINCH has to
+    // reach this thread rather than a background reader
+    AsyncIo io;
+    initAsyncIo(&io, !options->follow);
+    int spliced = setOutputWriterSplice(&state.out);
+    if (spliced < 0 || (!spliced && setOutputWriterAsync(&state.out, &io) < 0))
+    {
+        freeOutputWriter(&state.out);
+        freeAsyncIo(&io);
+        free(state.history);
+        freeLineCache(state.cache);
+        free(chunks);
+        return -1;
+    }
+    sig_atomic_t seenResizes = terminalResizeCount;
+    int watched = options->follow || isatty(STDOUT_FILENO);
+    stats.streamed = 1;
+    unsigned long long start = statsClock();
+
+    int result = 0;
+    int endOfInput = 0;
+    int current = 0; // Chunk the read in flight goes to
+    startAsyncRead(&io, fd, chunks, STREAM_CHUNK_SIZE);
+    while (!endOfInput)
+    {
+        if (!asyncReadReady(&io, 0))
+        {
+            // The input pauses: show the lines printed so far instead of waiting
+            if (flushOutputWriter(&state.out) < 0)
+            {
+                result = -1;
+                break;
+            }
+            // A block held back is only cut short for someone watching, and
+            // only once the input has really stopped; otherwise its padding
+            // would depend on how the writes of the producer are timed
+            if (state.windowLineCount > 0 && watched && !asyncReadReady(&io, STREAM_PAUSE_MS))
+            {
+                flushStreamWindow(&state);
+                if (flushOutputWriter(&state.out) < 0)
+                {
+                    result = -1;
+                    break;
+                }
+            }
+            if (options->follow && followResizes(&state, fd, &seenResizes) < 0)
+            {
+                result = -1;
+                break;
+            }
+        }
+        else if (state.out.error)
+        {
+            result = -1;
+            break;
+        }
+
+        unsigned long long readStart = statsClock();
+        ssize_t bytesRead = waitAsyncRead(&io);
+        addStatTime(&stats.readNanos, readStart);
+        if (bytesRead < 0)
+        {
+            if (errno == EINTR)
+            {
+                startAsyncRead(&io, fd, chunks + current * STREAM_CHUNK_SIZE, STREAM_CHUNK_SIZE);
+                continue;
+            }
+            perror("Error reading from stdin");
+            result = -1;
+            break;
+        }
+        if (bytesRead == 0)
+            break; // EOF
+        addStat(&stats.bytesIn, (unsigned long long)bytesRead);
+
+        // Read ahead into the other chunk while this one is centered
+        char *chunk = chunks + current * STREAM_CHUNK_SIZE;
+        current ^= 1;
+        startAsyncRead(&io, fd, chunks + current * STREAM_CHUNK_SIZE, STREAM_CHUNK_SIZE);
+
+        const char *chunkEnd = chunk + bytesRead;
+        const char *lineStart = chunk;
+
+        while (lineStart < chunkEnd)
+        {
+            if (state.passThrough)
+            {
+                // Rest of a line wider than the area: print it up to its end unmeasured
+                const char *lineEnd = (const char *)memchr(lineStart, '\n', chunkEnd - lineStart);
+                const char *nul = (const char *)memchr(lineStart, '\0', (lineEnd ? lineEnd : chunkEnd) - lineStart);
+                if (nul)
+                    lineEnd = nul;
+                writerAppend(&state.out, lineStart, (lineEnd ? lineEnd : chunkEnd) - lineStart);
+                if (!lineEnd)
+                    break; // The line continues in the next chunk
+                writerPutChar(&state.out, '\n');
+                state.passThrough = 0;
+                if (nul)
+                {
+                    endOfInput = 1; // Null byte ends the input
+                    break;
+                }
+                lineStart = lineEnd + 1;
+                continue;
+            }
+
+            // The rest of a line carried over from the previous chunk is no
+            // line of its own, so it is neither looked up nor cached
+            int lineWidth;
+            LineCache *cache = state.carryLength > 0 ? NULL : state.cache;
+            const char *lineEnd = scanLineCached(cache, lineStart, chunkEnd, state.layout.tabSize, &lineWidth);
+            if (lineEnd == chunkEnd || *lineEnd == '\0')
+            {
+                // Unfinished line (continues in the next chunk) or null byte
+                if (appendToCarry(&state, lineStart, lineEnd - lineStart) < 0)
+                {
+                    result = -1;
+                    endOfInput = 1;
+                }
+                else if (lineEnd == chunkEnd)
+                    checkPassThrough(&state);
+                if (lineEnd != chunkEnd)
+                    endOfInput = 1; // Null byte ends the input
+                break;
+            }
+
+            if (state.carryLength > 0)
+            {
+                // Line started in a previous chunk
+                if (appendToCarry(&state, lineStart, lineEnd - lineStart) < 0)
+                {
+                    result = -1;
+                    endOfInput = 1;
+                    break;
+                }
+                int status = streamLine(&state, state.carry, state.carryLength,
+                                        getDisplayWidth(state.carry, state.carryLength, state.layout.tabSize));
+                state.carryLength = 0;
+                state.carryCheck = 0;
+                if (status < 0)
+                {
+                    result = -1;
+                    endOfInput = 1;
+                    break;
+                }
+            }
+            else if (streamLine(&state, lineStart, lineEnd - lineStart, lineWidth) < 0)
+            {
+                result = -1;
+                endOfInput = 1;
+                break;
+            }
+            lineStart = lineEnd + 1;
+        }
+    }
 
-    char *buffer = (char *)malloc(fileSize + 1);
-    if (buffer == NULL)
+    // Last line without trailing newline
+    if (result == 0 && state.passThrough)
+        writerPutChar(&state.out, '\n');
+    if (result == 0 && state.carryLength > 0)
     {
-        perror("Memory allocation error for file content buffer");
-        fclose(file);
+        if (streamLine(&state, state.carry, state.carryLength,
+                       getDisplayWidth(state.carry, state.carryLength, state.layout.tabSize)) < 0)
+            result = -1;
+    }
+    if (result == 0)
+        flushStreamWindow(&state);
+    if (result == 0 && options->follow)
+    {
+        // Nothing more to read: keep the screen centered until interrupted
+        if (flushOutputWriter(&state.out) < 0 || followResizes(&state, -1, &seenResizes) < 0)
+            result = -1;
+    }
+
+    if (freeOutputWriter(&state.out) < 0)
+        result = -1;
+    if (stats.enabled)
+        stats.outputNanos = statsClock() - start - stats.readNanos;
+    freeWrapBuffer(&state.wrap);
+    freeAsyncIo(&io); // Cancels a read ahead past a null byte
+    for (size_t i = 0; state.history && i < FOLLOW_HISTORY_LINES; i++)
+    {
+        free(state.history[i].text);
+    }
+    free(state.history);
+    freeLineCache(state.cache);
+    free(state.windowLines);
+    free(state.window);
+    free(state.carry);
+    free(chunks);
+    return result;
+}
+
+/**
+ * Reusable state of the library interface, see libcntr.h. The document is
+ * parsed into again and again: resetting its counts keeps the line and
+ * paragraph arrays in its arena, so like the wrap and output buffers they
+ * are only allocated until they fit the largest text.
+ */
+struct CntrContext
+{
+    RenderOptions options; // Layout settings, including the cached terminal width
+    Document *doc;         // Document every text is parsed into
+    WrapBuffer wrap;       // Buffers for wrapping wide lines
+    OutputWriter out;      // In-memory writer the centered text is formatted into
+};
+
+CntrContext *cntrCreate(const CntrOptions *options)
+{
+    CntrContext *ctx = (CntrContext *)calloc(1, sizeof(CntrContext));
+    if (!ctx)
+    {
+        perror("Memory allocation error for context");
         return NULL;
     }
+    if (options)
+    {
+        ctx->options.wrap = options->wrap || options->balance;
+        ctx->options.balance = options->balance;
+        ctx->options.block = options->block;
+        ctx->options.tabSize = options->tabSize;
+        ctx->options.expandTabs = options->expandTabs;
+        ctx->options.align = options->align;
+        ctx->options.offset = options->offset > 0 ? options->offset : 0;
+    }
+    if (ctx->options.tabSize <= 0)
+        ctx->options.tabSize = DEFAULT_TAB_SIZE;
+    cntrSetWidth(ctx, options ? options->width : 0);
 
-    size_t bytesRead = fread(buffer, 1, fileSize, file);
-    if (bytesRead < fileSize && ferror(file))
+    ctx->doc = createDocument();
+    if (!ctx->doc || initOutputWriter(&ctx->out, -1) < 0)
     {
-        perror("Error reading file");
-        fclose(file);
-        free(buffer);
+        freeDocument(ctx->doc);
+        free(ctx);
         return NULL;
     }
-    buffer[bytesRead] = '\0'; // Null-terminate string
+    return ctx;
+}
 
-    fclose(file);
-    return buffer;
+void cntrSetWidth(CntrContext *ctx, int width)
+{
+    ctx->options.terminalWidth = width > 0 ? width : getTerminalWidth();
+}
+
+const char *cntrCenter(CntrContext *ctx, const char *text, size_t length, size_t *outLength)
+{
+    Document *doc = ctx->doc;
+    doc->lineCount = 0;
+    doc->paragraphCount = 0;
+    int paragraphBreak = 1;
+    if (parseRange(doc, text, text + length, ctx->options.tabSize, NULL, &paragraphBreak) < 0)
+        return NULL;
+
+    RenderOptions layout = ctx->options;
+    if (prepareBlockWidths(doc, &layout, &ctx->wrap) < 0)
+        return NULL;
+    ctx->out.length = 0;
+    ctx->out.error = 0;
+    renderLines(&ctx->out, doc, 0, doc->lineCount, &layout, &ctx->wrap);
+    writerPutChar(&ctx->out, '\0');
+    if (ctx->out.error)
+        return NULL;
+
+    if (outLength)
+        *outLength = ctx->out.length - 1;
+    return ctx->out.buffer;
+}
+
+int cntrCenterToFd(CntrContext *ctx, int fd, const char *text, size_t length)
+{
+    size_t centeredLength;
+    const char *centered = cntrCenter(ctx, text, length, &centeredLength);
+    if (!centered)
+        return -1;
+    struct iovec iov = {(void *)centered, centeredLength};
+    return writeAll(fd, &iov, 1);
 }
 
+void cntrFree(CntrContext *ctx)
+{
+    if (!ctx)
+        return;
+    freeDocument(ctx->doc);
+    freeWrapBuffer(&ctx->wrap);
+    freeOutputWriter(&ctx->out);
+    free(ctx);
+}
+
+/**
+ * Warm state of --serve for one connection at a time: a library context and
+ * the buffer requests are read into
+ */
+typedef struct
+{
+    CntrContext *ctx;       // Centers the requests
+    char *request;          // Text of the current request
+    size_t requestCapacity; // Capacity of the request buffer
+} ServeSession;
+
+/**
+ * Sessions of finished connections, handed to the next ones so that a
+ * connection per request still finds warm buffers
+ */
+typedef struct
+{
+    CntrOptions options;                      // Settings for new contexts
+    ServeSession *idle[SERVE_IDLE_SESSIONS];  // Sessions not in use
+    int idleCount;                            // Number of sessions in idle
+    int active;                               // Connections being served
+    pthread_mutex_t lock;
+    pthread_cond_t finished;                  // Signaled whenever a connection ends
+} ServePool;
+
 /**
- * Reads the entire content from Standard Input (stdin) into a dynamically allocated string.
+ * Reads exactly the given number of bytes, retrying after partial reads
+ * and signals.
  *
- * @return Dynamically allocated string with the content from stdin, or NULL on error.
+ * @return 1 on success, 0 at end of input before the first byte, -1 on
+ *         error or if the input ends early.
  */
-char *readStdinToString()
+static int readFull(int fd, void *buffer, size_t length)
 {
-    size_t capacity = 1024; // Initial capacity
-    size_t size = 0;
-    char *buffer = (char *)malloc(capacity);
-    if (!buffer)
+    size_t done = 0;
+    while (done < length)
     {
-        perror("Memory allocation error for stdin buffer");
-        return NULL;
+        ssize_t bytesRead = read(fd, (char *)buffer + done, length - done);
+        if (bytesRead < 0)
+        {
+            if (errno == EINTR)
+                continue;
+            perror("Error reading request");
+            return -1;
+        }
+        if (bytesRead == 0)
+        {
+            if (done == 0)
+                return 0;
+            fprintf(stderr, "Error: Request ends early.\n");
+            return -1;
+        }
+        done += bytesRead;
     }
+    return 1;
+}
 
-    size_t bytesRead;
-    // Read in chunks until EOF is reached
-    while ((bytesRead = fread(buffer + size, 1, capacity - size - 1, stdin)) > 0)
+/**
+ * Answers requests until the end of the input. Requests and replies are
+ * framed alike: a 4-byte big-endian length, then that many bytes of text.
+ *
+ * @param inFd File descriptor the requests come from.
+ * @param outFd File descriptor the replies go to.
+ * @return 0 at the end of the input, -1 on error.
+ */
+int serveConnection(ServeSession *session, int inFd, int outFd)
+{
+    for (;;)
     {
-        size += bytesRead;
-
-        // Check if buffer is full (only space left for '\0')
-        if (size >= capacity - 1)
+        unsigned char header[4];
+        int status = readFull(inFd, header, sizeof(header));
+        if (status <= 0)
+            return status;
+        size_t length = (size_t)header[0] << 24 | (size_t)header[1] << 16 | (size_t)header[2] << 8 | header[3];
+        if (length > SERVE_MAX_REQUEST)
         {
-            size_t newCapacity = capacity * 2;
-            // Check for potential overflow before doubling
-            if (newCapacity < capacity)
-            {
-                fprintf(stderr, "Error: Buffer capacity overflow for stdin.\n");
-                free(buffer);
-                return NULL;
-            }
-            char *newBuffer = (char *)realloc(buffer, newCapacity);
-            if (!newBuffer)
+            fprintf(stderr, "Error: Request of %zu bytes is too large.\n", length);
+            return -1;
+        }
+        if (length > session->requestCapacity)
+        {
+            char *request = (char *)realloc(session->request, length);
+            if (!request)
             {
-                perror("Memory reallocation error for stdin buffer");
-                free(buffer);
-                return NULL;
+                perror("Reallocation error for request buffer");
+                return -1;
             }
-            buffer = newBuffer;
-            capacity = newCapacity;
+            session->request = request;
+            session->requestCapacity = length;
+        }
+        status = length > 0 ? readFull(inFd, session->request, length) : 1;
+        if (status == 0)
+            fprintf(stderr, "Error: Request ends early.\n");
+        if (status <= 0)
+            return -1;
+
+        size_t replyLength;
+        const char *reply = cntrCenter(session->ctx, session->request, length, &replyLength);
+        if (!reply)
+            return -1;
+        if (replyLength > UINT32_MAX)
+        {
+            fprintf(stderr, "Error: Reply of %zu bytes is too large.\n", replyLength);
+            return -1;
+        }
+        unsigned char replyHeader[4] = {(unsigned char)(replyLength >> 24), (unsigned char)(replyLength >> 16),
+                                        (unsigned char)(replyLength >> 8), (unsigned char)replyLength};
+        struct iovec iov[2] = {{replyHeader, sizeof(replyHeader)}, {(void *)reply, replyLength}};
+        if (writeAll(outFd, iov, 2) < 0)
+        {
+            perror("Error writing reply");
+            return -1;
         }
     }
+}
 
-    // Check for read errors (other than EOF)
-    if (ferror(stdin))
+/**
+ * Creates a session with the given settings
+ *
+ * @return The session, or NULL on allocation failure.
+ */
+static ServeSession *createServeSession(const CntrOptions *options)
+{
+    ServeSession *session = (ServeSession *)calloc(1, sizeof(ServeSession));
+    if (!session)
     {
-        perror("Error reading from stdin");
-        free(buffer);
+        perror("Memory allocation error for session");
         return NULL;
     }
+    session->ctx = cntrCreate(options);
+    if (!session->ctx)
+    {
+        free(session);
+        return NULL;
+    }
+    return session;
+}
 
-    buffer[size] = '\0'; // Null-terminate string
-    return buffer;
+static void freeServeSession(ServeSession *session)
+{
+    cntrFree(session->ctx);
+    free(session->request);
+    free(session);
+}
+
+/**
+ * Connection of the socket server, handed to its thread
+ */
+typedef struct
+{
+    ServePool *pool; // Source of warm sessions
+    int fd;          // Connected socket
+} ServeClient;
+
+/**
+ * Thread function: answers the requests of one connection with a session
+ * from the pool, then returns the session
+ */
+static void *serveClientThread(void *arg)
+{
+    ServeClient *client = (ServeClient *)arg;
+    ServePool *pool = client->pool;
+
+    pthread_mutex_lock(&pool->lock);
+    ServeSession *session = pool->idleCount > 0 ? pool->idle[--pool->idleCount] : NULL;
+    pthread_mutex_unlock(&pool->lock);
+    if (!session)
+        session = createServeSession(&pool->options);
+
+    if (session)
+        serveConnection(session, client->fd, client->fd);
+    close(client->fd);
+    free(client);
+
+    pthread_mutex_lock(&pool->lock);
+    int kept = session && pool->idleCount < SERVE_IDLE_SESSIONS;
+    if (kept)
+        pool->idle[pool->idleCount++] = session;
+    pool->active--;
+    pthread_cond_signal(&pool->finished);
+    pthread_mutex_unlock(&pool->lock);
+    if (session && !kept)
+        freeServeSession(session);
+    return NULL;
+}
+
+/**
+ * Binds a listening Unix socket. A socket file that is left over from a
+ * server that is gone (nobody accepts on it) is replaced.
+ *
+ * @return The listening socket, or -1 on error.
+ */
+static int listenOnSocket(const char *path)
+{
+    struct sockaddr_un address;
+    memset(&address, 0, sizeof(address));
+    address.sun_family = AF_UNIX;
+    if (strlen(path) >= sizeof(address.sun_path))
+    {
+        fprintf(stderr, "Error: Socket path '%s' is too long.\n", path);
+        return -1;
+    }
+    strcpy(address.sun_path, path);
+
+    int listener = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (listener < 0)
+    {
+        perror("Error creating socket");
+        return -1;
+    }
+    struct stat st;
+    if (stat(path, &st) == 0 && S_ISSOCK(st.st_mode))
+    {
+        int probe = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+        if (probe >= 0 && connect(probe, (struct sockaddr *)&address, sizeof(address)) < 0 && errno == ECONNREFUSED)
+            unlink(path);
+        if (probe >= 0)
+            close(probe);
+    }
+    if (bind(listener, (struct sockaddr *)&address, sizeof(address)) < 0 || listen(listener, SOMAXCONN) < 0)
+    {
+        perror("Error listening on socket");
+        close(listener);
+        return -1;
+    }
+    return listener;
+}
+
+/**
+ * Runs the --serve mode: answers framed requests (see serveConnection)
+ * with warm state. Without a socket path, requests come from stdin and
+ * replies go to stdout, for use as a coprocess. With one, every connection
+ * to the Unix socket is served by its own thread, up to
+ * SERVE_MAX_CONNECTIONS at once; further clients wait in the listen
+ * backlog until one of them ends.
+ *
+ * @param path Path of the Unix socket to listen on, or NULL.
+ * @param options Settings for the centered text.
+ * @return 0 when stdin ends, -1 on error; the socket server only returns on error.
+ */
+int serve(const char *path, const CntrOptions *options)
+{
+    signal(SIGPIPE, SIG_IGN); // A client that goes away only ends its connection
+
+    if (!path)
+    {
+        ServeSession *session = createServeSession(options);
+        if (!session)
+            return -1;
+        int result = serveConnection(session, STDIN_FILENO, STDOUT_FILENO);
+        freeServeSession(session);
+        return result;
+    }
+
+    int listener = listenOnSocket(path);
+    if (listener < 0)
+        return -1;
+    ServePool pool;
+    memset(&pool, 0, sizeof(pool));
+    pool.options = *options;
+    pthread_mutex_init(&pool.lock, NULL);
+    pthread_cond_init(&pool.finished, NULL);
+
+    pthread_attr_t attributes;
+    pthread_attr_init(&attributes);
+    pthread_attr_setdetachstate(&attributes, PTHREAD_CREATE_DETACHED);
+    for (;;)
+    {
+        pthread_mutex_lock(&pool.lock);
+        while (pool.active >= SERVE_MAX_CONNECTIONS)
+        {
+            pthread_cond_wait(&pool.finished, &pool.lock);
+        }
+        pthread_mutex_unlock(&pool.lock);
+
+        int fd = accept4(listener, NULL, NULL, SOCK_CLOEXEC);
+        if (fd < 0)
+        {
+            if (errno == EINTR || errno == ECONNABORTED)
+                continue;
+            perror("Error accepting connection");
+            break;
+        }
+        ServeClient *client = (ServeClient *)malloc(sizeof(ServeClient));
+        pthread_t thread;
+        if (!client)
+        {
+            perror("Memory allocation error for connection");
+            close(fd);
+            continue;
+        }
+        pthread_mutex_lock(&pool.lock);
+        pool.active++; // Only the connection threads lower it
+        pthread_mutex_unlock(&pool.lock);
+        client->pool = &pool;
+        client->fd = fd;
+        if (pthread_create(&thread, &attributes, serveClientThread, client) != 0)
+            serveClientThread(client); // Serve it right here instead
+    }
+    // Detached threads may still use the pool, so it is left to process exit
+    close(listener);
+    return -1;
+}
+
+/**
+ * Prints the numbers collected for --stats to stderr; registered with atexit
+ */
+void printStats()
+{
+    struct rusage usage;
+    long peakKilobytes = getrusage(RUSAGE_SELF, &usage) == 0 ? usage.ru_maxrss : -1;
+    unsigned long long writeNanos = stats.writeNanos < stats.outputNanos ? stats.writeNanos : stats.outputNanos;
+
+    fprintf(stderr, "cntr stats:\n");
+    fprintf(stderr, "  read          %10.3f ms%s\n", stats.readNanos / 1e6, stats.streamed ? " (waiting for input)" : "");
+    if (stats.streamed)
+        fprintf(stderr, "  parse+render  %10.3f ms (width is measured while lines are split)\n",
+                (stats.outputNanos - writeNanos) / 1e6);
+    else
+    {
+        fprintf(stderr, "  parse+width   %10.3f ms (width is measured while lines are split)\n", stats.parseNanos / 1e6);
+        fprintf(stderr, "  render        %10.3f ms\n", (stats.outputNanos - writeNanos) / 1e6);
+    }
+    fprintf(stderr, "  write         %10.3f ms (blocked on output)\n", writeNanos / 1e6);
+    fprintf(stderr, "  bytes in      %10llu\n", stats.bytesIn);
+    fprintf(stderr, "  bytes out     %10llu\n", stats.bytesOut);
+    fprintf(stderr, "  lines         %10llu\n", stats.lines);
+    fprintf(stderr, "  paragraphs    %10llu\n", stats.paragraphs);
+    fprintf(stderr, "  array growths %10llu (addLineToParagraph, addParagraphToDocument)\n", stats.documentGrowths);
+    fprintf(stderr, "  arena mallocs %10llu, reallocs %llu\n", stats.arenaMallocs, stats.arenaReallocs);
+    fprintf(stderr, "  write calls   %10llu\n", stats.writeCalls);
+    if (stats.cacheHits + stats.cacheMisses > 0)
+        fprintf(stderr, "  line cache    %10llu hits, %llu misses\n", stats.cacheHits, stats.cacheMisses);
+    fprintf(stderr, "  width kernel  %10s\n", widthKernelName());
+    fprintf(stderr, "  peak RSS      %10ld KB\n", peakKilobytes);
+}
+
+/**
+ * Prints the command line help
+ */
+void printUsage(const char *program)
+{
+    fprintf(stderr, "Usage: %s [options] [<filename>...]\n", program);
+    fprintf(stderr, "  Reads the files one after another, or standard input if no file is specified.\n");
+    fprintf(stderr, "  -w, --wrap       Wrap lines wider than the terminal at word boundaries\n");
+    fprintf(stderr, "  -b, --balance    Wrap with line breaks that make the lines as even as possible\n");
+    fprintf(stderr, "  --block[=paragraph|document]\n");
+    fprintf(stderr, "                   Center the lines of each paragraph (or of the whole input) as one block\n");
+    fprintf(stderr, "  -t, --tabsize=N  Tab stops every N columns (default %d)\n", DEFAULT_TAB_SIZE);
+    fprintf(stderr, "  -e, --expand-tabs\n");
+    fprintf(stderr, "                   Print tabs as spaces, so they line up regardless of the padding\n");
+    fprintf(stderr, "  -H, --header     Print the name of each file above its lines\n");
+    fprintf(stderr, "  --serve[=SOCKET] Center requests of a 4-byte big-endian length and the text, answered\n");
+    fprintf(stderr, "                   the same way, from stdin to stdout or on a Unix socket\n");
+    fprintf(stderr, "  --align=left|center|right\n");
+    fprintf(stderr, "                   Where lines go in their area (default center)\n");
+    fprintf(stderr, "  --width=N        Align in N columns instead of the terminal's width\n");
+    fprintf(stderr, "  --columns=A-B    Align in the columns A to B (counted from 1)\n");
+    fprintf(stderr, "  --line-cache     Remember the widths of repeated lines (separators, headers) instead\n");
+    fprintf(stderr, "                   of measuring them again\n");
+    fprintf(stderr, "  --stats          Print timings and counters of the stages to stderr at exit\n");
+    fprintf(stderr, "  -f, --follow     Stay running and recenter the last screen of lines when the terminal is resized\n");
 }
 
+#ifndef CNTR_NO_MAIN // Defined by programs that include cntr.c for its functions, see tools/bench.c
 int main(int argc, char *argv[])
 {
-    // Set locale for correct UTF-8 handling
-    setlocale(LC_ALL, "");
+    RenderOptions options;
+    memset(&options, 0, sizeof(options));
+    options.tabSize = DEFAULT_TAB_SIZE;
+    int serveMode = 0;
+    const char *servePath = NULL; // Unix socket for --serve, NULL for stdin and stdout
+
+    static const struct option longOptions[] = {
+        {"wrap", no_argument, NULL, 'w'},
+        {"balance", no_argument, NULL, 'b'},
+        {"block", optional_argument, NULL, 'B'},
+        {"tabsize", required_argument, NULL, 't'},
+        {"expand-tabs", no_argument, NULL, 'e'},
+        {"follow", no_argument, NULL, 'f'},
+        {"header", no_argument, NULL, 'H'},
+        {"stats", no_argument, NULL, 'S'},
+        {"serve", optional_argument, NULL, 'C'},
+        {"line-cache", no_argument, NULL, 'L'},
+        {"align", required_argument, NULL, 'a'},
+        {"width", required_argument, NULL, 'W'},
+        {"columns", required_argument, NULL, 'c'},
+        {NULL, 0, NULL, 0},
+    };
+    int opt;
+    while ((opt = getopt_long(argc, argv, "wbt:efH", longOptions, NULL)) != -1)
+    {
+        switch (opt)
+        {
+        case 'w':
+            options.wrap = 1;
+            break;
+        case 'b':
+            options.wrap = 1;
+            options.balance = 1;
+            break;
+        case 'B':
+            if (!optarg || strcmp(optarg, "paragraph") == 0)
+                options.block = BLOCK_PARAGRAPH;
+            else if (strcmp(optarg, "document") == 0)
+                options.block = BLOCK_DOCUMENT;
+            else
+            {
+                fprintf(stderr, "Error: Unknown block mode '%s'.\n", optarg);
+                return 1;
+            }
+            break;
+        case 't':
+        {
+            char *end;
+            long tabSize = strtol(optarg, &end, 10);
+            if (*optarg == '\0' || *end != '\0' || tabSize < 1 || tabSize > 256)
+            {
+                fprintf(stderr, "Error: Invalid tab size '%s'.\n", optarg);
+                return 1;
+            }
+            options.tabSize = (int)tabSize;
+            break;
+        }
+        case 'e':
+            options.expandTabs = 1;
+            break;
+        case 'f':
+            options.follow = isatty(STDOUT_FILENO); // Nothing to redraw in a pipe or file
+            break;
+        case 'H':
+            options.header = 1;
+            break;
+        case 'a':
+            if (strcmp(optarg, "center") == 0)
+                options.align = ALIGN_CENTER;
+            else if (strcmp(optarg, "left") == 0)
+                options.align = ALIGN_LEFT;
+            else if (strcmp(optarg, "right") == 0)
+                options.align = ALIGN_RIGHT;
+            else
+            {
+                fprintf(stderr, "Error: Unknown alignment '%s'.\n", optarg);
+                return 1;
+            }
+            break;
+        case 'W':
+        {
+            char *end;
+            long width = strtol(optarg, &end, 10);
+            if (*optarg == '\0' || *end != '\0' || width < 1 || width > MAX_AREA_WIDTH)
+            {
+                fprintf(stderr, "Error: Invalid width '%s'.\n", optarg);
+                return 1;
+            }
+            options.terminalWidth = (int)width;
+            options.offset = 0;
+            options.fixedWidth = 1;
+            break;
+        }
+        case 'c':
+        {
+            // Range of 1-based columns, both included: A-B
+            char *end;
+            long first = strtol(optarg, &end, 10);
+            long last = *end == '-' ? strtol(end + 1, &end, 10) : 0;
+            if (*optarg == '\0' || *end != '\0' || first < 1 || last < first || last > MAX_AREA_WIDTH)
+            {
+                fprintf(stderr, "Error: Invalid column range '%s'.\n", optarg);
+                return 1;
+            }
+            options.terminalWidth = (int)(last - first + 1);
+            options.offset = (int)(first - 1);
+            options.fixedWidth = 1;
+            break;
+        }
+        case 'L':
+            options.lineCache = 1;
+            break;
+        case 'C':
+            serveMode = 1;
+            servePath = optarg;
+            break;
+        case 'S':
+            if (!stats.enabled)
+                atexit(printStats);
+            stats.enabled = 1;
+            break;
+        default:
+            printUsage(argv[0]);
+            return 1;
+        }
+    }
+    watchTerminalResize();
+    if (!options.fixedWidth)
+        options.terminalWidth = getTerminalWidth();
+
+    if (serveMode)
+    {
+        if (optind < argc)
+        {
+            // "--serve PATH" would be taken as a file operand, which serving never reads
+            fprintf(stderr, "Error: --serve reads no files; give the socket as --serve=SOCKET.\n");
+            return 1;
+        }
+        CntrOptions serveOptions = {options.terminalWidth, options.wrap,       options.balance,
+                                    options.block,         options.tabSize,    options.expandTabs,
+                                    options.align,         options.offset};
+        return serve(servePath, &serveOptions) == 0 ? 0 : 1;
+    }
 
     char *inputContent = NULL;
+    size_t inputLength = 0;
+    size_t mappedLength = 0; // Non-zero if inputContent is memory-mapped
 
     // Decide whether to read from file or stdin
-    if (argc == 2)
+    int argumentCount = argc - optind;
+    if (argumentCount > 1 || (argumentCount == 1 && options.header))
     {
-        // Read from file
-        inputContent = readFileToString(argv[1]);
+        // Several files: loaded in parallel, printed in order
+        return centerFiles(argv + optind, (size_t)argumentCount, &options) == 0 ? 0 : 1;
     }
-    else if (argc == 1)
+    else if (argumentCount == 1)
     {
-        // Read from stdin (pipe)
-        inputContent = readStdinToString();
+        // Read from file
+        unsigned long long start = statsClock();
+        inputContent = mapFileToString(argv[optind], &mappedLength, &inputLength);
+        addStatTime(&stats.readNanos, start);
     }
     else
     {
-        // Incorrect number of arguments
-        fprintf(stderr, "Usage: %s [<filename>]\n", argv[0]);
-        fprintf(stderr, "  Reads from <filename> or from standard input if no file is specified.\n");
-        return 1;
+        struct stat st;
+        if (fstat(STDIN_FILENO, &st) == -1 || !S_ISREG(st.st_mode))
+        {
+            // Pipe or terminal: center lines as they arrive
+            return centerStream(STDIN_FILENO, &options) == 0 ? 0 : 1;
+        }
+
+        // Read from stdin (redirected file)
+        unsigned long long start = statsClock();
+        inputContent = readStdinToString(&mappedLength, &inputLength);
+        addStatTime(&stats.readNanos, start);
     }
 
     // Check if reading was successful
     if (!inputContent)
     {
-        // Error message already printed in readFileToString or readStdinToString
+        // Error message already printed in mapFileToString or readStdinToString
         return 1;
     }
 
     // Parse file content (or stdin content) into a document
-    Document *doc = parseDocument(inputContent);
+    addStat(&stats.bytesIn, inputLength);
+    unsigned long long start = statsClock();
+    LineCache *cache = options.lineCache ? createLineCache() : NULL;
+    Document *doc = parseDocument(inputContent, inputLength, options.tabSize, cache);
+    freeLineCache(cache); // The widths are in the document now
+    addStatTime(&stats.parseNanos, start);
     if (!doc)
     {
         fprintf(stderr, "Error parsing document.\n");
-        free(inputContent);
+        freeFileContent(inputContent, mappedLength);
         return 1;
     }
 
+    addStat(&stats.lines, doc->lineCount);
+    addStat(&stats.paragraphs, doc->paragraphCount);
+
     // Print the document centered
-    printCenteredDocument(doc);
+    start = statsClock();
+    int result = (options.follow ? followDocument(doc, &options) : printCenteredDocument(doc, &options)) == 0 ? 0 : 1;
+    addStatTime(&stats.outputNanos, start);
 
-    // Cleanup
+#ifndef CNTR_SKIP_TEARDOWN
+    // Cleanup (the arena makes this cheap; define CNTR_SKIP_TEARDOWN to leave it to process exit)
     freeDocument(doc);
-    free(inputContent); // Free the read content
+    freeFileContent(inputContent, mappedLength); // Free the read content
+#endif
 
-    return 0;
+    return result;
 }
+#endif
@@ -0,0 +1,94 @@
+/*
+ * libcntr: centers text inside another program, without running cntr.
+ *
+ * A context keeps everything a call needs: the options, the terminal
+ * width, and the document, wrap and output buffers. Once those buffers
+ * have grown to the largest input seen, later calls do not allocate at
+ * all, so a context can be kept for the lifetime of a service and used
+ * for every message. A context must not be used by two threads at once;
+ * give each thread its own.
+ *
+ * The library is built from cntr.c:
+ *
+ *   gcc -O3 -pthread -fPIC -shared -fvisibility=hidden -DCNTR_NO_MAIN cntr.c -o libcntr.so
+ */
+#ifndef LIBCNTR_H
+#define LIBCNTR_H
+
+#include <stddef.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define CNTR_API __attribute__((visibility("default")))
+
+#define CNTR_BLOCK_NONE 0      // Every line is centered on its own
+#define CNTR_BLOCK_PARAGRAPH 1 // The lines of a paragraph share one left padding
+#define CNTR_BLOCK_DOCUMENT 2  // All lines share one left padding
+
+#define CNTR_ALIGN_CENTER 0 // Lines are centered
+#define CNTR_ALIGN_LEFT 1   // Lines start at the left edge of the area
+#define CNTR_ALIGN_RIGHT 2  // Lines end at the right edge of the area
+
+/**
+ * Settings of a context; zero-initialized fields select the defaults
+ */
+typedef struct
+{
+    int width;      // Columns to center in; 0 for the width of the terminal on stdout
+    int wrap;       // Wrap lines wider than width at word boundaries
+    int balance;    // When wrapping, choose breaks that even out line widths
+    int block;      // CNTR_BLOCK_NONE, CNTR_BLOCK_PARAGRAPH or CNTR_BLOCK_DOCUMENT
+    int tabSize;    // Columns between tab stops; 0 for 8
+    int expandTabs; // Print tabs as spaces up to the next tab stop
+    int align;      // CNTR_ALIGN_CENTER, CNTR_ALIGN_LEFT or CNTR_ALIGN_RIGHT
+    int offset;     // Columns left of the area of width columns the lines are aligned in
+} CntrOptions;
+
+typedef struct CntrContext CntrContext;
+
+/**
+ * Creates a context.
+ *
+ * @param options Settings, or NULL for the defaults.
+ * @return The context (release with cntrFree), or NULL on allocation failure.
+ */
+CNTR_API CntrContext *cntrCreate(const CntrOptions *options);
+
+/**
+ * Changes the width a context centers in, e.g. after the terminal was resized.
+ *
+ * @param width Columns to center in; 0 to ask the terminal on stdout again.
+ */
+CNTR_API void cntrSetWidth(CntrContext *ctx, int width);
+
+/**
+ * Centers a text into the context's output buffer. Paragraphs, widths and
+ * the end at a null byte work exactly as in the cntr program.
+ *
+ * @param text The text (need not be null-terminated).
+ * @param length Length of the text in bytes.
+ * @param outLength Receives the length of the result, may be NULL.
+ * @return The centered text, null-terminated and valid until the next call
+ *         with ctx, or NULL on allocation failure.
+ */
+CNTR_API const char *cntrCenter(CntrContext *ctx, const char *text, size_t length, size_t *outLength);
+
+/**
+ * Centers a text and writes it to a file descriptor.
+ *
+ * @return 0 on success, -1 on error (with errno set by the failed write).
+ */
+CNTR_API int cntrCenterToFd(CntrContext *ctx, int fd, const char *text, size_t length);
+
+/**
+ * Releases a context and its buffers
+ */
+CNTR_API void cntrFree(CntrContext *ctx);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
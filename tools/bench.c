@@ -0,0 +1,326 @@
+/*
+ * Benchmark of the cntr pipeline on synthetic corpora. Each corpus is
+ * written to a temporary file, then the stages are timed one by one:
+ * reading the file (readFileToString; mapFileToString including the page
+ * faults of one pass over the mapping; and readStdinToString with the
+ * corpus fed through a pipe, so its read(2) path is measured rather than
+ * one mmap), parseDocument, getDisplayWidth over all parsed lines, and
+ * printCenteredDocument into /dev/null. Every stage runs several times and
+ * the fastest run is reported in MB/s and lines/s.
+ *
+ *   gcc -O3 -pthread tools/bench.c -o bench && ./bench [size in MB] [runs]
+ *
+ * Build it with the same flags as cntr (e.g. -march=native) to measure
+ * what they change.
+ */
+#define CNTR_NO_MAIN
+#include "../cntr.c"
+
+#include <time.h>
+
+#define DEFAULT_CORPUS_MB 32 // Size of each corpus unless given on the command line
+#define DEFAULT_RUNS 3       // Runs per stage unless given on the command line
+
+/**
+ * Growable byte buffer the corpora are generated into
+ */
+typedef struct
+{
+    char *data;
+    size_t length;
+    size_t capacity;
+} Corpus;
+
+static void corpusAppend(Corpus *corpus, const char *text, size_t length)
+{
+    if (corpus->length + length > corpus->capacity)
+    {
+        size_t newCapacity = corpus->capacity ? corpus->capacity : 4096;
+        while (newCapacity < corpus->length + length)
+        {
+            newCapacity *= 2;
+        }
+        corpus->data = (char *)realloc(corpus->data, newCapacity);
+        if (!corpus->data)
+        {
+            perror("Memory allocation error for corpus");
+            exit(1);
+        }
+        corpus->capacity = newCapacity;
+    }
+    memcpy(corpus->data + corpus->length, text, length);
+    corpus->length += length;
+}
+
+static void corpusPrint(Corpus *corpus, const char *format, int a, int b)
+{
+    char line[256];
+    int length = snprintf(line, sizeof(line), format, a, b);
+    corpusAppend(corpus, line, (size_t)length);
+}
+
+/**
+ * Small deterministic generator, so every run sees the same corpora
+ */
+static unsigned int nextRandom(unsigned int *state)
+{
+    *state = *state * 1103515245u + 12345u;
+    return (*state >> 16) & 0x7FFF;
+}
+
+// Log lines of varying length
+static void generateAsciiLog(Corpus *corpus, size_t size)
+{
+    static const char *levels[] = {"INFO", "WARN", "DEBUG", "ERROR"};
+    unsigned int seed = 1;
+    while (corpus->length < size)
+    {
+        int n = (int)nextRandom(&seed);
+        corpusPrint(corpus, "2024-05-17 12:%02d:%02d ", n % 60, (n / 60) % 60);
+        corpusAppend(corpus, levels[n % 4], strlen(levels[n % 4]));
+        corpusPrint(corpus, " worker-%d request id=%d", n % 32, n);
+        int words = (int)(nextRandom(&seed) % 12);
+        for (int i = 0; i < words; i++)
+        {
+            corpusAppend(corpus, " payload", 8);
+        }
+        corpusPrint(corpus, " took %dms status=%d\n", n % 977, 200 + n % 3 * 100);
+    }
+}
+
+// Chinese and Japanese text: three-byte UTF-8, mostly double width
+static void generateCjk(Corpus *corpus, size_t size)
+{
+    static const char *words[] = {"中文", "文本", "居中", "显示", "終端", "日本語", "テキスト", "、", "。"};
+    unsigned int seed = 2;
+    while (corpus->length < size)
+    {
+        int count = 4 + (int)(nextRandom(&seed) % 16);
+        for (int i = 0; i < count; i++)
+        {
+            const char *word = words[nextRandom(&seed) % 9];
+            corpusAppend(corpus, word, strlen(word));
+        }
+        corpusAppend(corpus, "\n", 1);
+    }
+}
+
+// Colored output as it comes from grep --color or ls --color
+static void generateAnsi(Corpus *corpus, size_t size)
+{
+    unsigned int seed = 3;
+    while (corpus->length < size)
+    {
+        int n = (int)nextRandom(&seed);
+        corpusPrint(corpus, "\033[1;3%dm%05d\033[0m ", 1 + n % 6, n);
+        corpusAppend(corpus, "src/module.c:", 13);
+        corpusPrint(corpus, "\033[32m%d\033[0m: matched \033[01;31m\033[Kpattern\033[m\033[K in line %d\n", n % 5000,
+                    n % 313);
+    }
+}
+
+// One line of words without a single newline
+static void generateGiantLine(Corpus *corpus, size_t size)
+{
+    static const char words[] = "lorem ipsum dolor sit amet consectetur adipiscing elit ";
+    while (corpus->length < size)
+    {
+        corpusAppend(corpus, words, sizeof(words) - 1);
+    }
+}
+
+// Thousands of one-word paragraphs
+static void generateTinyParagraphs(Corpus *corpus, size_t size)
+{
+    unsigned int seed = 5;
+    while (corpus->length < size)
+    {
+        corpusPrint(corpus, "p%d\n\n", (int)(nextRandom(&seed) % 1000), 0);
+    }
+}
+
+static double now()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/**
+ * Writes a corpus into a pipe for the stdin stage
+ */
+typedef struct
+{
+    int fd;               // Write end of the pipe, closed when done
+    const Corpus *corpus; // Text to write
+} PipeFeed;
+
+static void *feedPipe(void *arg)
+{
+    PipeFeed *feed = (PipeFeed *)arg;
+    struct iovec iov = {feed->corpus->data, feed->corpus->length};
+    if (writeAll(feed->fd, &iov, 1) < 0)
+        perror("Error feeding pipe");
+    close(feed->fd);
+    return NULL;
+}
+
+static void report(const char *corpus, const char *stage, double seconds, size_t bytes, size_t lines)
+{
+    printf("%-16s %-20s %10.1f MB/s %14.0f lines/s\n", corpus, stage, bytes / seconds / 1e6, lines / seconds);
+}
+
+/**
+ * Times all stages on one corpus
+ */
+static void benchCorpus(const char *name, const Corpus *corpus, int runs)
+{
+    char path[] = "/tmp/cntr_bench_XXXXXX";
+    int fd = mkstemp(path);
+    struct iovec iov = {corpus->data, corpus->length};
+    if (fd < 0 || writeAll(fd, &iov, 1) < 0)
+    {
+        perror("Error writing corpus");
+        exit(1);
+    }
+    close(fd);
+
+    RenderOptions options;
+    memset(&options, 0, sizeof(options));
+    options.terminalWidth = 80;
+    options.tabSize = DEFAULT_TAB_SIZE;
+
+    int savedStdin = dup(STDIN_FILENO);
+    int savedStdout = dup(STDOUT_FILENO);
+    int devNull = open("/dev/null", O_WRONLY);
+    long pageSize = sysconf(_SC_PAGESIZE);
+    double best[6] = {1e30, 1e30, 1e30, 1e30, 1e30, 1e30};
+    size_t lines = 0;
+    for (int run = 0; run < runs; run++)
+    {
+        size_t length;
+        double start = now();
+        char *text = readFileToString(path, &length);
+        double elapsed = now() - start;
+        if (!text)
+            exit(1);
+        if (elapsed < best[0])
+            best[0] = elapsed;
+        free(text);
+
+        size_t mappedLength;
+        start = now();
+        text = mapFileToString(path, &mappedLength, &length);
+        volatile char touched = 0; // Fault in every page, as parsing would
+        for (size_t i = 0; text && i < length; i += (size_t)pageSize)
+        {
+            touched += text[i];
+        }
+        elapsed = now() - start;
+        if (!text)
+            exit(1);
+        if (elapsed < best[1])
+            best[1] = elapsed;
+        freeFileContent(text, mappedLength);
+
+        int fds[2];
+        pthread_t feeder;
+        if (pipe(fds) < 0)
+        {
+            perror("Error creating pipe");
+            exit(1);
+        }
+        PipeFeed feed = {fds[1], corpus};
+        dup2(fds[0], STDIN_FILENO);
+        close(fds[0]);
+        start = now();
+        if (pthread_create(&feeder, NULL, feedPipe, &feed) != 0)
+        {
+            perror("Error starting pipe feeder");
+            exit(1);
+        }
+        text = readStdinToString(&mappedLength, &length);
+        elapsed = now() - start;
+        pthread_join(feeder, NULL);
+        dup2(savedStdin, STDIN_FILENO);
+        if (!text)
+            exit(1);
+        if (elapsed < best[2])
+            best[2] = elapsed;
+
+        start = now();
+        Document *doc = parseDocument(text, length, options.tabSize, NULL);
+        elapsed = now() - start;
+        if (!doc)
+            exit(1);
+        if (elapsed < best[3])
+            best[3] = elapsed;
+        lines = doc->lineCount;
+
+        volatile long long total = 0; // Keeps the loop from being optimized away
+        start = now();
+        for (size_t i = 0; i < doc->lineCount; i++)
+        {
+            total += getDisplayWidth(doc->lines[i].text, doc->lines[i].length, options.tabSize);
+        }
+        elapsed = now() - start;
+        if (elapsed < best[4])
+            best[4] = elapsed;
+
+        fflush(stdout);
+        dup2(devNull, STDOUT_FILENO);
+        start = now();
+        printCenteredDocument(doc, &options);
+        elapsed = now() - start;
+        dup2(savedStdout, STDOUT_FILENO);
+        if (elapsed < best[5])
+            best[5] = elapsed;
+
+        freeDocument(doc);
+        freeFileContent(text, mappedLength);
+    }
+    close(devNull);
+    close(savedStdin);
+    close(savedStdout);
+    unlink(path);
+
+    report(name, "readFileToString", best[0], corpus->length, lines);
+    report(name, "mapFileToString", best[1], corpus->length, lines);
+    report(name, "readStdinToString", best[2], corpus->length, lines);
+    report(name, "parseDocument", best[3], corpus->length, lines);
+    report(name, "getDisplayWidth", best[4], corpus->length, lines);
+    report(name, "printCentered", best[5], corpus->length, lines);
+}
+
+int main(int argc, char *argv[])
+{
+    size_t size = (size_t)(argc > 1 ? atoi(argv[1]) : DEFAULT_CORPUS_MB) * 1024 * 1024;
+    int runs = argc > 2 ? atoi(argv[2]) : DEFAULT_RUNS;
+    if (size == 0 || runs < 1)
+    {
+        fprintf(stderr, "Usage: %s [size in MB] [runs]\n", argv[0]);
+        return 1;
+    }
+
+    static const struct
+    {
+        const char *name;
+        void (*generate)(Corpus *, size_t);
+    } corpora[] = {
+        {"ascii-log", generateAsciiLog},
+        {"cjk", generateCjk},
+        {"ansi-color", generateAnsi},
+        {"giant-line", generateGiantLine},
+        {"tiny-paragraphs", generateTinyParagraphs},
+    };
+    printf("%-16s %-20s %15s %22s\n", "corpus", "stage", "throughput", "lines");
+    for (size_t i = 0; i < sizeof(corpora) / sizeof(corpora[0]); i++)
+    {
+        Corpus corpus;
+        memset(&corpus, 0, sizeof(corpus));
+        corpora[i].generate(&corpus, size);
+        benchCorpus(corpora[i].name, &corpus, runs);
+        free(corpus.data);
+    }
+    return 0;
+}
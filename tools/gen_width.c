@@ -0,0 +1,276 @@
+/*
+ * Generates cntr_width.h: the UTF-8 decoder tables and the display width
+ * table used by getDisplayWidth.
+ *
+ * The widths are taken from the C library's wcwidth in a UTF-8 locale, so
+ * regenerating on a system with a newer C library picks up newer Unicode
+ * data:
+ *
+ *   gcc tools/gen_width.c -o gen_width && ./gen_width > cntr_width.h
+ */
+#define _XOPEN_SOURCE 700
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <locale.h>
+#include <wchar.h>
+
+#define CODEPOINT_COUNT 0x110000
+#define BLOCK_SIZE 256                       // Code points per second-level block
+#define BLOCK_BYTES (BLOCK_SIZE / 4)         // Widths are packed 2 bits each
+#define BLOCK_COUNT (CODEPOINT_COUNT / BLOCK_SIZE)
+
+// Byte classes of the UTF-8 decoder
+enum
+{
+    CLASS_ASCII,    // 00-7F
+    CLASS_CONT_80,  // 80-83
+    CLASS_CONT_84,  // 84-87
+    CLASS_CONT_88,  // 88-8F
+    CLASS_CONT_90,  // 90-9F
+    CLASS_CONT_A0,  // A0-BF
+    CLASS_INVALID,  // C0-C1, FE-FF
+    CLASS_LEAD2,    // C2-DF
+    CLASS_E0,       // E0 (second byte A0-BF, no overlongs)
+    CLASS_LEAD3,    // E1-EC, EE-EF
+    CLASS_ED,       // ED (second byte 80-9F, no surrogates)
+    CLASS_F0,       // F0 (second byte 90-BF)
+    CLASS_LEAD4,    // F1-F7
+    CLASS_F8,       // F8 (second byte 88-BF)
+    CLASS_LEAD5,    // F9-FB
+    CLASS_FC,       // FC (second byte 84-BF)
+    CLASS_LEAD6,    // FD
+    CLASS_COUNT
+};
+
+// Decoder states: how many continuation bytes are missing, and whether the
+// next one is restricted to avoid overlong forms or surrogates
+enum
+{
+    STATE_ACCEPT,
+    STATE_REJECT,
+    STATE_NEED1,
+    STATE_NEED2,
+    STATE_NEED3,
+    STATE_NEED4,
+    STATE_NEED5,
+    STATE_E0,
+    STATE_ED,
+    STATE_F0,
+    STATE_F8,
+    STATE_FC,
+    STATE_COUNT
+};
+
+static int byteClass(int b)
+{
+    if (b < 0x80)
+        return CLASS_ASCII;
+    if (b < 0x84)
+        return CLASS_CONT_80;
+    if (b < 0x88)
+        return CLASS_CONT_84;
+    if (b < 0x90)
+        return CLASS_CONT_88;
+    if (b < 0xA0)
+        return CLASS_CONT_90;
+    if (b < 0xC0)
+        return CLASS_CONT_A0;
+    if (b < 0xC2 || b >= 0xFE)
+        return CLASS_INVALID;
+    if (b < 0xE0)
+        return CLASS_LEAD2;
+    if (b == 0xE0)
+        return CLASS_E0;
+    if (b == 0xED)
+        return CLASS_ED;
+    if (b < 0xF0)
+        return CLASS_LEAD3;
+    if (b == 0xF0)
+        return CLASS_F0;
+    if (b < 0xF8)
+        return CLASS_LEAD4;
+    if (b == 0xF8)
+        return CLASS_F8;
+    if (b < 0xFC)
+        return CLASS_LEAD5;
+    if (b == 0xFC)
+        return CLASS_FC;
+    return CLASS_LEAD6;
+}
+
+static int isContinuation(int cls)
+{
+    return cls >= CLASS_CONT_80 && cls <= CLASS_CONT_A0;
+}
+
+static int transition(int state, int cls)
+{
+    switch (state)
+    {
+    case STATE_ACCEPT:
+        switch (cls)
+        {
+        case CLASS_ASCII:
+            return STATE_ACCEPT;
+        case CLASS_LEAD2:
+            return STATE_NEED1;
+        case CLASS_E0:
+            return STATE_E0;
+        case CLASS_LEAD3:
+            return STATE_NEED2;
+        case CLASS_ED:
+            return STATE_ED;
+        case CLASS_F0:
+            return STATE_F0;
+        case CLASS_LEAD4:
+            return STATE_NEED3;
+        case CLASS_F8:
+            return STATE_F8;
+        case CLASS_LEAD5:
+            return STATE_NEED4;
+        case CLASS_FC:
+            return STATE_FC;
+        case CLASS_LEAD6:
+            return STATE_NEED5;
+        default:
+            return STATE_REJECT;
+        }
+    case STATE_NEED1:
+    case STATE_NEED2:
+    case STATE_NEED3:
+    case STATE_NEED4:
+    case STATE_NEED5:
+        if (!isContinuation(cls))
+            return STATE_REJECT;
+        return state == STATE_NEED1 ? STATE_ACCEPT : state - 1;
+    case STATE_E0:
+        return cls == CLASS_CONT_A0 ? STATE_NEED1 : STATE_REJECT;
+    case STATE_ED:
+        return cls >= CLASS_CONT_80 && cls <= CLASS_CONT_90 ? STATE_NEED1 : STATE_REJECT;
+    case STATE_F0:
+        return cls >= CLASS_CONT_90 && cls <= CLASS_CONT_A0 ? STATE_NEED2 : STATE_REJECT;
+    case STATE_F8:
+        return cls >= CLASS_CONT_88 && cls <= CLASS_CONT_A0 ? STATE_NEED3 : STATE_REJECT;
+    case STATE_FC:
+        return cls >= CLASS_CONT_84 && cls <= CLASS_CONT_A0 ? STATE_NEED4 : STATE_REJECT;
+    default:
+        return STATE_REJECT;
+    }
+}
+
+static int leadMask(int cls)
+{
+    switch (cls)
+    {
+    case CLASS_ASCII:
+        return 0x7F;
+    case CLASS_LEAD2:
+        return 0x1F;
+    case CLASS_E0:
+    case CLASS_LEAD3:
+    case CLASS_ED:
+        return 0x0F;
+    case CLASS_F0:
+    case CLASS_LEAD4:
+        return 0x07;
+    case CLASS_F8:
+    case CLASS_LEAD5:
+        return 0x03;
+    case CLASS_FC:
+    case CLASS_LEAD6:
+        return 0x01;
+    default:
+        return 0;
+    }
+}
+
+int main(void)
+{
+    if (!setlocale(LC_ALL, "C.UTF-8") && !setlocale(LC_ALL, "en_US.UTF-8"))
+    {
+        fprintf(stderr, "gen_width: no UTF-8 locale available\n");
+        return 1;
+    }
+
+    static unsigned char blocks[BLOCK_COUNT][BLOCK_BYTES];
+    static int blockIndex[BLOCK_COUNT];
+    static int uniqueBlocks[BLOCK_COUNT];
+    int uniqueCount = 0;
+
+    for (int block = 0; block < BLOCK_COUNT; block++)
+    {
+        memset(blocks[block], 0, BLOCK_BYTES);
+        for (int i = 0; i < BLOCK_SIZE; i++)
+        {
+            int width = wcwidth((wchar_t)(block * BLOCK_SIZE + i));
+            if (width < 0)
+                width = 1; // Non-printable characters count as width 1
+            blocks[block][i / 4] |= (unsigned char)(width << ((i % 4) * 2));
+        }
+
+        int found = -1;
+        for (int u = 0; u < uniqueCount && found < 0; u++)
+        {
+            if (memcmp(blocks[uniqueBlocks[u]], blocks[block], BLOCK_BYTES) == 0)
+                found = u;
+        }
+        if (found < 0)
+        {
+            found = uniqueCount;
+            uniqueBlocks[uniqueCount++] = block;
+        }
+        blockIndex[block] = found;
+    }
+    if (uniqueCount > 256)
+    {
+        fprintf(stderr, "gen_width: %d distinct blocks do not fit an 8-bit index\n", uniqueCount);
+        return 1;
+    }
+
+    printf("/* Generated by tools/gen_width.c - do not edit. */\n\n");
+
+    printf("#define UTF8_ACCEPT %d\n#define UTF8_REJECT %d\n\n", STATE_ACCEPT, STATE_REJECT);
+
+    printf("/** Class of every byte for the UTF-8 decoder */\n");
+    printf("static const uint8_t utf8ByteClass[256] = {");
+    for (int b = 0; b < 256; b++)
+        printf("%s%d,", b % 16 ? " " : "\n    ", byteClass(b));
+    printf("\n};\n\n");
+
+    printf("/** Payload bits of a lead byte, by byte class */\n");
+    printf("static const uint8_t utf8LeadMask[%d] = {", CLASS_COUNT);
+    for (int c = 0; c < CLASS_COUNT; c++)
+        printf("%s0x%02X", c ? ", " : "", leadMask(c));
+    printf("};\n\n");
+
+    printf("/** Decoder state transitions, indexed by [state][byte class] */\n");
+    printf("static const uint8_t utf8Transition[%d][%d] = {\n", STATE_COUNT, CLASS_COUNT);
+    for (int s = 0; s < STATE_COUNT; s++)
+    {
+        printf("    {");
+        for (int c = 0; c < CLASS_COUNT; c++)
+            printf("%s%d", c ? ", " : "", transition(s, c));
+        printf("},\n");
+    }
+    printf("};\n\n");
+
+    printf("/** Second-level block of every 256 code points */\n");
+    printf("static const uint8_t widthStage1[%d] = {", BLOCK_COUNT);
+    for (int block = 0; block < BLOCK_COUNT; block++)
+        printf("%s%d,", block % 16 ? " " : "\n    ", blockIndex[block]);
+    printf("\n};\n\n");
+
+    printf("/** Display widths (0-2), 2 bits per code point, 4 code points per byte */\n");
+    printf("static const uint8_t widthStage2[%d][%d] = {\n", uniqueCount, BLOCK_BYTES);
+    for (int u = 0; u < uniqueCount; u++)
+    {
+        printf("    {");
+        for (int i = 0; i < BLOCK_BYTES; i++)
+            printf("%s0x%02X", i ? "," : "", blocks[uniqueBlocks[u]][i]);
+        printf("},\n");
+    }
+    printf("};\n");
+
+    return 0;
+}
@@ -0,0 +1,1126 @@
+/*
+ * Differential check of cntr. Every text is centered by a small reference
+ * written here independently of cntr.c: paragraphs are split with strstr,
+ * widths are counted one code point at a time with mbrtowc and wcwidth
+ * (the C library data cntr_width.h is generated from), and lines are
+ * wrapped by plain loops. Then the same text goes through every optimized
+ * path of cntr.c: each width kernel the CPU runs, the line cache, parallel
+ * parsing (with and without the cache) and rendering, the batch path with
+ * background writes, several files, the library, and streaming with random
+ * chunk boundaries and pauses, block modes included. Each output is
+ * written into a pipe, as it would be into a shell pipeline, and has to
+ * match the reference byte for byte; only differences are printed.
+ *
+ *   gcc -O2 -pthread tools/verify.c -o verify && ./verify 1000  # random texts
+ *   ./verify big.txt                                            # files, in each block and wrap mode
+ *   clang -g -O1 -fsanitize=fuzzer,address -pthread -DCNTR_FUZZ tools/verify.c -o cntr_fuzz && ./cntr_fuzz
+ *
+ * Random texts mix UTF-8, invalid bytes, control characters and escape
+ * sequences in random layouts; the same number of rounds always produces
+ * the same texts.
+ */
+#define CNTR_NO_MAIN
+#include "../cntr.c"
+
+#include <locale.h>
+#include <wchar.h>
+
+#define DEFAULT_ROUNDS 200             // Random texts unless given on the command line
+#define VERIFY_THREADS 4               // Threads of the parallel parser and renderer
+#define VERIFY_TEXT_SIZE (1024 * 1024) // Largest random text
+#define VERIFY_LONG_LINE (1100 * 1024) // Random lines this long reach the stream's pass-through
+#define FILE_WIDTH 80                  // Width files are centered in
+
+/**
+ * Growable byte buffer for the reference output and captured output
+ */
+typedef struct
+{
+    char *data;
+    size_t length;
+    size_t capacity;
+} Output;
+
+static void outputAppend(Output *out, const char *text, size_t length)
+{
+    if (out->length + length > out->capacity)
+    {
+        size_t newCapacity = out->capacity ? out->capacity : 4096;
+        while (newCapacity < out->length + length)
+        {
+            newCapacity *= 2;
+        }
+        out->data = (char *)realloc(out->data, newCapacity);
+        if (!out->data)
+        {
+            perror("Memory allocation error for verify output");
+            exit(1);
+        }
+        out->capacity = newCapacity;
+    }
+    memcpy(out->data + out->length, text, length);
+    out->length += length;
+}
+
+static void outputPad(Output *out, long count)
+{
+    for (long i = 0; i < count; i++)
+    {
+        outputAppend(out, " ", 1);
+    }
+}
+
+/*
+ * The reference. It shares no code with cntr.c, only the rules: a tab
+ * moves to the next tab stop counted from the start of the text, escape
+ * sequences take no columns, every other character takes what wcwidth
+ * says, and anything without a width (control characters, invalid or
+ * partial UTF-8) takes one column per byte.
+ */
+
+/**
+ * Returns the length of the escape sequence (ECMA-48) a text starts with,
+ * or 0 if its ESC starts none. CSI takes parameter and intermediate bytes
+ * up to a final byte; OSC, DCS, SOS, PM and APC strings run to BEL or
+ * ESC \; other sequences take intermediate bytes and a final byte. An
+ * unfinished sequence runs to the end of the text, a string also ends
+ * before a newline.
+ */
+static size_t referenceEscapeLength(const unsigned char *text, size_t length)
+{
+    if (length < 2)
+        return 0;
+    size_t i = 2;
+    switch (text[1])
+    {
+    case '[':
+        while (i < length && text[i] >= 0x20 && text[i] <= 0x3F)
+        {
+            i++;
+        }
+        return i < length && text[i] >= 0x40 && text[i] <= 0x7E ? i + 1 : i;
+    case ']':
+    case 'P':
+    case 'X':
+    case '^':
+    case '_':
+        for (; i < length && text[i] != '\n'; i++)
+        {
+            if (text[i] == 0x07)
+                return i + 1;
+            if (text[i] == 0x1B && i + 1 < length && text[i + 1] == '\\')
+                return i + 2;
+        }
+        return i;
+    default:
+        i = 1;
+        while (i < length && text[i] >= 0x20 && text[i] <= 0x2F)
+        {
+            i++;
+        }
+        if (i < length && text[i] >= 0x30 && text[i] <= 0x7E)
+            return i + 1;
+        return i > 1 ? i : 0;
+    }
+}
+
+/**
+ * Measures a text and, if expanded is given, appends it there with its
+ * tabs replaced by spaces up to the next tab stop.
+ *
+ * @return The width, at most INT_MAX.
+ */
+static int referenceMeasure(const char *text, size_t length, int tabSize, Output *expanded)
+{
+    const unsigned char *s = (const unsigned char *)text;
+    long long width = 0;
+    mbstate_t state;
+    memset(&state, 0, sizeof(state));
+    size_t i = 0;
+    while (i < length)
+    {
+        size_t n = 1;
+        long long columns = 1;
+        if (s[i] == '\t')
+        {
+            columns = tabSize - width % tabSize;
+            if (expanded)
+            {
+                outputPad(expanded, (long)columns);
+                width += columns;
+                i++;
+                continue;
+            }
+        }
+        else if (s[i] == 0x1B && (n = referenceEscapeLength(s + i, length - i)) > 0)
+        {
+            columns = 0;
+        }
+        else
+        {
+            wchar_t wc;
+            n = mbrtowc(&wc, text + i, length - i, &state);
+            if (n == (size_t)-1 || n == (size_t)-2 || n == 0)
+            {
+                memset(&state, 0, sizeof(state)); // One column for the byte, then start over
+                n = 1;
+            }
+            else
+            {
+                int w = wcwidth(wc);
+                columns = w < 0 ? 1 : w;
+            }
+        }
+        if (expanded)
+            outputAppend(expanded, text + i, n);
+        width += columns;
+        i += n;
+    }
+    return width > INT_MAX ? INT_MAX : (int)width;
+}
+
+/**
+ * A row of the reference output and the width it is aligned by
+ */
+typedef struct
+{
+    size_t offset; // Start of the row in the row text
+    size_t length; // Length in bytes
+    int width;     // Display width
+    int tabs;      // Printed from the input, so tabs are expanded with --expand-tabs
+} ReferenceRow;
+
+typedef struct
+{
+    ReferenceRow *rows;
+    size_t count;
+    size_t capacity;
+    Output text; // Bytes of all rows
+} ReferenceRows;
+
+static void addReferenceRow(ReferenceRows *rows, const char *text, size_t length, int width, int tabs)
+{
+    if (rows->count == rows->capacity)
+    {
+        rows->capacity = rows->capacity ? 2 * rows->capacity : 256;
+        rows->rows = (ReferenceRow *)realloc(rows->rows, rows->capacity * sizeof(ReferenceRow));
+        if (!rows->rows)
+        {
+            perror("Memory allocation error for verify rows");
+            exit(1);
+        }
+    }
+    ReferenceRow row = {rows->text.length, length, width, tabs};
+    rows->rows[rows->count++] = row;
+    outputAppend(&rows->text, text, length);
+}
+
+/**
+ * Adds the rows a line is printed as: the line itself, or with wrapping
+ * and a line wider than the area, its words on rows of at most that width,
+ * joined by single spaces. Breaks are greedy, or with balance the ones
+ * with the least sum of squared slack over all rows; a word wider than
+ * the area stands alone at no cost, and of equal layouts the one with the
+ * shortest last row wins.
+ */
+static void referenceLine(ReferenceRows *rows, const char *line, size_t length, const RenderOptions *options)
+{
+    int lineWidth = referenceMeasure(line, length, options->tabSize, NULL);
+    int maxWidth = options->terminalWidth;
+    size_t count = 0;
+    const char **words = NULL;
+    size_t *lengths = NULL;
+    long long *widths = NULL;
+    if (options->wrap && lineWidth > maxWidth)
+    {
+        words = (const char **)malloc((length / 2 + 1) * sizeof(char *));
+        lengths = (size_t *)malloc((length / 2 + 1) * sizeof(size_t));
+        widths = (long long *)malloc((length / 2 + 1) * sizeof(long long));
+        if (!words || !lengths || !widths)
+        {
+            perror("Memory allocation error for verify words");
+            exit(1);
+        }
+        size_t i = 0;
+        while (i < length)
+        {
+            if (strchr(" \t\r\v\f", line[i]))
+            {
+                i++;
+                continue;
+            }
+            size_t start = i;
+            while (i < length && !strchr(" \t\r\v\f", line[i]))
+            {
+                i++;
+            }
+            words[count] = line + start;
+            lengths[count] = i - start;
+            widths[count] = referenceMeasure(line + start, i - start, options->tabSize, NULL);
+            count++;
+        }
+    }
+    if (count == 0) // Not wrapped, or only whitespace
+    {
+        addReferenceRow(rows, line, length, lineWidth, 1);
+        free(words);
+        free(lengths);
+        free(widths);
+        return;
+    }
+
+    // ends[k] is the first word after row k
+    size_t *ends = (size_t *)malloc((count + 1) * sizeof(size_t));
+    size_t rowCount = 0;
+    if (!ends)
+    {
+        perror("Memory allocation error for verify rows");
+        exit(1);
+    }
+    if (!options->balance)
+    {
+        long long width = widths[0];
+        for (size_t k = 1; k < count; k++)
+        {
+            if (width + 1 + widths[k] <= maxWidth)
+            {
+                width += 1 + widths[k];
+            }
+            else
+            {
+                ends[rowCount++] = k;
+                width = widths[k];
+            }
+        }
+        ends[rowCount++] = count;
+    }
+    else
+    {
+        // best[j]: least cost of the first j words; start[j]: first word of their last row
+        unsigned long long *best = (unsigned long long *)malloc((count + 1) * sizeof(unsigned long long));
+        size_t *start = (size_t *)malloc((count + 1) * sizeof(size_t));
+        if (!best || !start)
+        {
+            perror("Memory allocation error for verify breaks");
+            exit(1);
+        }
+        best[0] = 0;
+        for (size_t j = 1; j <= count; j++)
+        {
+            best[j] = ULLONG_MAX;
+            for (size_t i = j; i-- > 0;)
+            {
+                long long width = (long long)(j - i - 1);
+                for (size_t k = i; k < j; k++)
+                {
+                    width += widths[k];
+                }
+                if (width > maxWidth && j - i > 1)
+                    break; // Neither this row nor longer ones fit
+                long long slack = width < maxWidth ? maxWidth - width : 0;
+                if (best[i] + (unsigned long long)(slack * slack) < best[j])
+                {
+                    best[j] = best[i] + (unsigned long long)(slack * slack);
+                    start[j] = i;
+                }
+            }
+        }
+        for (size_t j = count; j > 0; j = start[j])
+        {
+            ends[rowCount++] = j;
+        }
+        for (size_t k = 0; k < rowCount / 2; k++) // Collected back to front
+        {
+            size_t swap = ends[k];
+            ends[k] = ends[rowCount - 1 - k];
+            ends[rowCount - 1 - k] = swap;
+        }
+        free(best);
+        free(start);
+    }
+
+    Output row;
+    memset(&row, 0, sizeof(row));
+    size_t first = 0;
+    for (size_t k = 0; k < rowCount; k++)
+    {
+        row.length = 0;
+        long long width = -1;
+        for (size_t w = first; w < ends[k]; w++)
+        {
+            if (w > first)
+                outputAppend(&row, " ", 1);
+            outputAppend(&row, words[w], lengths[w]);
+            width += 1 + widths[w];
+        }
+        addReferenceRow(rows, row.data, row.length, width > INT_MAX ? INT_MAX : (int)width, 0);
+        first = ends[k];
+    }
+    free(row.data);
+    free(ends);
+    free(words);
+    free(lengths);
+    free(widths);
+}
+
+/**
+ * Centers a text the way cntr documents it: the text ends at a null byte;
+ * paragraphs are separated by empty lines and printed one newline apart;
+ * every row is aligned by its own width, or with --block by the widest row
+ * of its paragraph or of the document.
+ */
+static void referenceCenter(const char *text, size_t length, const RenderOptions *options, Output *out)
+{
+    const char *nul = (const char *)memchr(text, '\0', length);
+    size_t textLength = nul ? (size_t)(nul - text) : length;
+    char *copy = (char *)malloc(textLength + 1);
+    if (!copy)
+    {
+        perror("Memory allocation error for verify text");
+        exit(1);
+    }
+    memcpy(copy, text, textLength);
+    copy[textLength] = '\0';
+
+    // Rows of all paragraphs; ends[p] is the first row after paragraph p
+    ReferenceRows rows;
+    memset(&rows, 0, sizeof(rows));
+    size_t *ends = NULL;
+    size_t paragraphs = 0;
+    for (char *paragraph = copy; paragraph;)
+    {
+        char *next = strstr(paragraph, "\n\n");
+        if (next)
+            *next = '\0';
+        size_t before = rows.count;
+        for (char *line = paragraph; line;)
+        {
+            char *newline = strchr(line, '\n');
+            size_t lineLength = newline ? (size_t)(newline - line) : strlen(line);
+            if (lineLength > 0)
+                referenceLine(&rows, line, lineLength, options);
+            line = newline ? newline + 1 : NULL;
+        }
+        if (rows.count > before)
+        {
+            ends = (size_t *)realloc(ends, (paragraphs + 1) * sizeof(size_t));
+            if (!ends)
+            {
+                perror("Memory allocation error for verify paragraphs");
+                exit(1);
+            }
+            ends[paragraphs++] = rows.count;
+        }
+        paragraph = next ? next + 2 : NULL;
+    }
+
+    int documentWidth = 0;
+    for (size_t r = 0; r < rows.count; r++)
+    {
+        if (rows.rows[r].width > documentWidth)
+            documentWidth = rows.rows[r].width;
+    }
+    size_t r = 0;
+    for (size_t p = 0; p < paragraphs; p++)
+    {
+        int paragraphWidth = 0;
+        for (size_t k = r; k < ends[p]; k++)
+        {
+            if (rows.rows[k].width > paragraphWidth)
+                paragraphWidth = rows.rows[k].width;
+        }
+        if (p > 0)
+            outputAppend(out, "\n", 1);
+        for (; r < ends[p]; r++)
+        {
+            const ReferenceRow *row = &rows.rows[r];
+            int width = options->block == BLOCK_DOCUMENT    ? documentWidth
+                        : options->block == BLOCK_PARAGRAPH ? paragraphWidth
+                                                            : row->width;
+            long slack = width < options->terminalWidth ? (long)options->terminalWidth - width : 0;
+            if (options->align == ALIGN_LEFT)
+                slack = 0;
+            else if (options->align == ALIGN_CENTER)
+                slack /= 2;
+            outputPad(out, options->offset + slack);
+            const char *rowText = rows.text.data + row->offset;
+            if (options->expandTabs && row->tabs)
+                referenceMeasure(rowText, row->length, options->tabSize, out);
+            else
+                outputAppend(out, rowText, row->length);
+            outputAppend(out, "\n", 1);
+        }
+    }
+    free(ends);
+    free(rows.rows);
+    free(rows.text.data);
+    free(copy);
+}
+
+/*
+ * The modes of cntr.c that are compared with the reference
+ */
+
+/**
+ * A text and layout that verifyText runs through every way of centering
+ */
+typedef struct
+{
+    const char *text;             // The text
+    size_t length;                // Length of the text in bytes
+    const RenderOptions *options; // Layout settings
+    unsigned int seed;            // Chooses where the stream's input is split
+} VerifyCase;
+
+/**
+ * Small deterministic generator for the random texts and chunk boundaries
+ */
+static unsigned int verifyRandom(unsigned int *state)
+{
+    *state = *state * 1103515245u + 12345u;
+    return (*state >> 16) & 0x7FFF;
+}
+
+/**
+ * Renders a parsed document on one thread, without background writes
+ */
+static int renderDocumentSerial(Document *doc, const RenderOptions *options)
+{
+    RenderOptions layout = *options;
+    WrapBuffer wrap;
+    memset(&wrap, 0, sizeof(wrap));
+    OutputWriter out;
+    if (prepareBlockWidths(doc, &layout, &wrap) < 0 || initOutputWriter(&out, STDOUT_FILENO) < 0)
+    {
+        freeWrapBuffer(&wrap);
+        return -1;
+    }
+    renderLines(&out, doc, 0, doc->lineCount, &layout, &wrap);
+    freeWrapBuffer(&wrap);
+    return freeOutputWriter(&out);
+}
+
+/**
+ * Parses (through parseRange, however long the text is) and renders on one
+ * thread, with the width kernel that is in use
+ */
+static int verifySerial(const VerifyCase *c, LineCache *cache)
+{
+    Document *doc = createDocument();
+    if (!doc)
+        return -1;
+    int paragraphBreak = 1;
+    int result = parseRange(doc, c->text, c->text + c->length, c->options->tabSize, cache, &paragraphBreak);
+    if (result >= 0) // 1 if the text ended at a null byte
+        result = renderDocumentSerial(doc, c->options);
+    freeDocument(doc);
+    return result;
+}
+
+static int verifyKernel(const VerifyCase *c)
+{
+    return verifySerial(c, NULL);
+}
+
+static int verifyLineCache(const VerifyCase *c)
+{
+    LineCache *cache = createLineCache();
+    if (!cache)
+        return -1;
+    // Parsed once before, so repeated lines take their widths from the cache
+    Document *doc = parseDocument(c->text, c->length, c->options->tabSize, cache);
+    int result = doc ? verifySerial(c, cache) : -1;
+    freeDocument(doc);
+    freeLineCache(cache);
+    return result;
+}
+
+static int verifyParallel(const VerifyCase *c, int lineCache)
+{
+    Document *doc = parseDocumentParallel(c->text, c->length, c->options->tabSize, VERIFY_THREADS, lineCache);
+    if (!doc)
+        return -1;
+    int result = renderDocumentSerial(doc, c->options);
+    freeDocument(doc);
+    return result;
+}
+
+static int verifyParallelParse(const VerifyCase *c)
+{
+    return verifyParallel(c, 0);
+}
+
+static int verifyParallelParseCached(const VerifyCase *c)
+{
+    return verifyParallel(c, 1);
+}
+
+static int verifyParallelRender(const VerifyCase *c)
+{
+    Document *doc = parseDocument(c->text, c->length, c->options->tabSize, NULL);
+    if (!doc)
+        return -1;
+    RenderOptions layout = *c->options;
+    WrapBuffer wrap;
+    memset(&wrap, 0, sizeof(wrap));
+    int result = prepareBlockWidths(doc, &layout, &wrap);
+    freeWrapBuffer(&wrap);
+    if (result == 0)
+        result = printCenteredDocumentParallel(doc, STDOUT_FILENO, &layout, VERIFY_THREADS);
+    freeDocument(doc);
+    return result;
+}
+
+// The batch path of the program, with its own choice of parallel and background work
+static int verifyPrint(const VerifyCase *c)
+{
+    Document *doc = parseDocument(c->text, c->length, c->options->tabSize, NULL);
+    if (!doc)
+        return -1;
+    int result = printCenteredDocument(doc, c->options);
+    freeDocument(doc);
+    return result;
+}
+
+/**
+ * Centers two copies of the text as files given on the command line, so
+ * they are loaded (and mapped, if large enough) on the file threads
+ */
+static int verifyFiles(const VerifyCase *c)
+{
+    int fd = memfd_create("cntr-verify", MFD_CLOEXEC);
+    if (fd < 0)
+    {
+        perror("Error creating verify file");
+        return -1;
+    }
+    size_t done = 0;
+    while (done < c->length)
+    {
+        ssize_t n = write(fd, c->text + done, c->length - done);
+        if (n < 0)
+        {
+            perror("Error writing verify file");
+            close(fd);
+            return -1;
+        }
+        done += (size_t)n;
+    }
+    char path[64];
+    snprintf(path, sizeof(path), "/proc/self/fd/%d", fd);
+    char *filenames[] = {path, path};
+    int result = centerFiles(filenames, 2, c->options);
+    close(fd);
+    return result;
+}
+
+static int verifyLibrary(const VerifyCase *c)
+{
+    const RenderOptions *options = c->options;
+    CntrOptions libraryOptions = {options->terminalWidth, options->wrap,       options->balance,
+                                  options->block,         options->tabSize,    options->expandTabs,
+                                  options->align,         options->offset};
+    CntrContext *ctx = cntrCreate(&libraryOptions);
+    if (!ctx)
+        return -1;
+    int result = cntrCenterToFd(ctx, STDOUT_FILENO, c->text, c->length);
+    cntrFree(ctx);
+    return result;
+}
+
+/**
+ * Input of a stream, sent in pieces of random size
+ */
+typedef struct
+{
+    int fd;            // Socket the pieces are sent to, closed at the end
+    const char *text;  // The text
+    size_t length;     // Length of the text in bytes
+    unsigned int seed; // Chooses the piece sizes
+} StreamFeed;
+
+static void *feedStreamWorker(void *arg)
+{
+    StreamFeed *feed = (StreamFeed *)arg;
+    size_t offset = 0;
+    while (offset < feed->length)
+    {
+        // Mostly tiny pieces, which split lines, characters and escape sequences anywhere
+        size_t limit = verifyRandom(&feed->seed) % 4 ? 64 : STREAM_CHUNK_SIZE;
+        size_t piece = ((size_t)verifyRandom(&feed->seed) << 15 | verifyRandom(&feed->seed)) % limit + 1;
+        if (piece > feed->length - offset)
+            piece = feed->length - offset;
+        if (verifyRandom(&feed->seed) % 256 == 0)
+            usleep(1000); // Now and then the stream finds the input paused
+        if (send(feed->fd, feed->text + offset, piece, MSG_NOSIGNAL) < 0)
+        {
+            if (errno == EINTR)
+                continue;
+            break; // The stream stopped reading at a null byte
+        }
+        offset += piece;
+    }
+    close(feed->fd);
+    return NULL;
+}
+
+/**
+ * Tells whether every block of a text fits the window a stream holds back
+ * for block alignment. A larger block is aligned by its lines up to where
+ * the window filled, so only then the stream may differ from the batch path.
+ */
+static int blocksFitStreamWindow(const VerifyCase *c)
+{
+    if (c->options->block == BLOCK_NONE)
+        return 1;
+    if (c->options->block == BLOCK_DOCUMENT)
+    {
+        // Every line is held back, empty ones included
+        size_t lines = 0;
+        for (const char *p = c->text; (p = (const char *)memchr(p, '\n', c->text + c->length - p)); p++)
+        {
+            lines++;
+        }
+        return lines < STREAM_WINDOW_LINES && c->length < STREAM_WINDOW_SIZE;
+    }
+
+    Document *doc = parseDocument(c->text, c->length, c->options->tabSize, NULL);
+    if (!doc)
+        return 0;
+    int fits = 1;
+    for (size_t i = 0; i < doc->paragraphCount && fits; i++)
+    {
+        const Paragraph *para = &doc->paragraphs[i];
+        if (para->lineCount == 0)
+            continue;
+        const LineSpan *first = &doc->lines[para->firstLine];
+        const LineSpan *last = &doc->lines[para->firstLine + para->lineCount - 1];
+        fits = para->lineCount < STREAM_WINDOW_LINES &&
+               (size_t)(last->text + last->length - first->text) < STREAM_WINDOW_SIZE;
+    }
+    freeDocument(doc);
+    return fits;
+}
+
+/**
+ * Centers the text as a stream. Each read of a datagram socket returns
+ * exactly one piece, so the chunk boundaries are the random piece
+ * boundaries. In block modes the output does not depend on them either,
+ * as long as the blocks fit the window.
+ */
+static int verifyStreamWith(const VerifyCase *c, int lineCache)
+{
+    if (!blocksFitStreamWindow(c))
+        return 1;
+    int fds[2];
+    if (socketpair(AF_UNIX, SOCK_SEQPACKET, 0, fds) < 0)
+    {
+        perror("Error creating stream socket");
+        return -1;
+    }
+    StreamFeed feed = {fds[1], c->text, c->length, c->seed};
+    pthread_t thread;
+    if (pthread_create(&thread, NULL, feedStreamWorker, &feed) != 0)
+    {
+        close(fds[0]);
+        close(fds[1]);
+        return -1;
+    }
+    RenderOptions layout = *c->options;
+    layout.lineCache = lineCache;
+    int result = centerStream(fds[0], &layout);
+    close(fds[0]); // Unblocks the feeder if the stream stopped early
+    pthread_join(thread, NULL);
+    return result;
+}
+
+static int verifyStream(const VerifyCase *c)
+{
+    return verifyStreamWith(c, 0);
+}
+
+static int verifyStreamCached(const VerifyCase *c)
+{
+    return verifyStreamWith(c, 1);
+}
+
+/**
+ * Reads everything written into a pipe until its last writer closes it
+ */
+typedef struct
+{
+    int fd;        // Read end of the pipe
+    Output output; // What was read
+    int error;     // A read failed
+} PipeDrain;
+
+static void *drainPipeWorker(void *arg)
+{
+    PipeDrain *drain = (PipeDrain *)arg;
+    char buffer[64 * 1024];
+    for (;;)
+    {
+        ssize_t n = read(drain->fd, buffer, sizeof(buffer));
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0)
+        {
+            drain->error = n < 0;
+            break;
+        }
+        outputAppend(&drain->output, buffer, (size_t)n);
+    }
+    return NULL;
+}
+
+/**
+ * Runs a mode with stdout redirected into a pipe that a thread drains, so
+ * the output goes through the same splice and write paths as in a shell
+ * pipeline.
+ *
+ * @param output Receives the output (release output->data with free).
+ * @return The result of the mode: 0, -1 on error, 1 if it does not apply.
+ */
+static int captureOutput(int (*mode)(const VerifyCase *), const VerifyCase *c, Output *output)
+{
+    memset(output, 0, sizeof(*output));
+    int fds[2];
+    if (pipe2(fds, O_CLOEXEC) < 0)
+    {
+        perror("Error creating capture pipe");
+        return -1;
+    }
+    PipeDrain drain;
+    memset(&drain, 0, sizeof(drain));
+    drain.fd = fds[0];
+    pthread_t thread;
+    if (pthread_create(&thread, NULL, drainPipeWorker, &drain) != 0)
+    {
+        close(fds[0]);
+        close(fds[1]);
+        return -1;
+    }
+    fflush(stdout);
+    int savedStdout = dup(STDOUT_FILENO);
+    int status = -1;
+    if (savedStdout < 0 || dup2(fds[1], STDOUT_FILENO) < 0)
+    {
+        perror("Error redirecting output");
+    }
+    else
+    {
+        status = mode(c);
+        dup2(savedStdout, STDOUT_FILENO); // Closes the last write end, so the drain sees the end
+    }
+    if (savedStdout >= 0)
+        close(savedStdout);
+    close(fds[1]);
+    pthread_join(thread, NULL);
+    close(fds[0]);
+    *output = drain.output;
+    if (drain.error)
+    {
+        perror("Error reading captured output");
+        status = -1;
+    }
+    return status;
+}
+
+/**
+ * Runs one mode and compares its output with the reference.
+ *
+ * @return 0 if it matches or does not apply, 1 if it differs or fails.
+ */
+static int checkMode(const char *name, int (*mode)(const VerifyCase *), const VerifyCase *c, const Output *reference)
+{
+    Output output;
+    int status = captureOutput(mode, c, &output);
+    if (status == 1)
+    {
+        free(output.data);
+        return 0;
+    }
+    if (status < 0)
+    {
+        fprintf(stderr, "verify: %s failed\n", name);
+        free(output.data);
+        return 1;
+    }
+    size_t common = output.length < reference->length ? output.length : reference->length;
+    size_t i = 0;
+    while (i < common && output.data[i] == reference->data[i])
+    {
+        i++;
+    }
+    free(output.data);
+    if (i == common && output.length == reference->length)
+        return 0;
+    fprintf(stderr, "verify: %s differs from the reference at byte %zu (%zu bytes instead of %zu)\n", name, i,
+            output.length, reference->length);
+    return 1;
+}
+
+/**
+ * Centers a text with the reference and in every mode of cntr.c.
+ *
+ * @param seed Chooses the chunk boundaries of the stream.
+ * @return Number of modes whose output differs (or failed).
+ */
+static int verifyText(const char *text, size_t length, const RenderOptions *options, unsigned int seed)
+{
+    static const struct
+    {
+        const char *name;
+        int (*run)(const VerifyCase *);
+        int files; // Prints the text this many times, one newline apart
+    } modes[] = {
+        {"line cache", verifyLineCache, 1},
+        {"parallel parse", verifyParallelParse, 1},
+        {"parallel parse with line cache", verifyParallelParseCached, 1},
+        {"parallel render", verifyParallelRender, 1},
+        {"batch output", verifyPrint, 1},
+        {"files", verifyFiles, 2},
+        {"library", verifyLibrary, 1},
+        {"stream", verifyStream, 1},
+        {"stream with line cache", verifyStreamCached, 1},
+    };
+
+    RenderOptions layout = *options;
+    layout.follow = 0;
+    layout.header = 0;
+    layout.lineCache = 0;
+    VerifyCase c = {text, length, &layout, seed};
+
+    Output reference;
+    memset(&reference, 0, sizeof(reference));
+    referenceCenter(text, length, &layout, &reference);
+    Output twice; // Output of two files: the text, a newline, the text again
+    memset(&twice, 0, sizeof(twice));
+    if (reference.length > 0)
+    {
+        outputAppend(&twice, reference.data, reference.length);
+        outputAppend(&twice, "\n", 1);
+        outputAppend(&twice, reference.data, reference.length);
+    }
+
+    int differences = 0;
+    const char *kernel = widthKernelName(); // Restored after the kernels were compared
+    for (size_t i = 0; i < WIDTH_KERNEL_COUNT; i++)
+    {
+        const char *name = widthKernels[i].name;
+        if (useWidthKernel(name) == 0)
+            differences += checkMode(name, verifyKernel, &c, &reference);
+    }
+    useWidthKernel(kernel);
+    for (size_t i = 0; i < sizeof(modes) / sizeof(modes[0]); i++)
+    {
+        differences += checkMode(modes[i].name, modes[i].run, &c, modes[i].files == 2 ? &twice : &reference);
+    }
+    free(reference.data);
+    free(twice.data);
+    return differences;
+}
+
+/**
+ * Switches to a UTF-8 locale, which mbrtowc and wcwidth need to decode
+ * and measure like cntr
+ */
+static void useUtf8Locale()
+{
+    if (!setlocale(LC_CTYPE, "C.UTF-8") && !setlocale(LC_CTYPE, "en_US.UTF-8"))
+    {
+        fprintf(stderr, "verify: no UTF-8 locale (C.UTF-8 or en_US.UTF-8) to measure with\n");
+        exit(1);
+    }
+}
+
+#ifdef CNTR_FUZZ
+int LLVMFuzzerInitialize(int *argc, char ***argv)
+{
+    (void)argc;
+    (void)argv;
+    useUtf8Locale();
+    return 0;
+}
+
+/**
+ * libFuzzer entry point: the first four bytes choose the layout, the rest
+ * is the text. Any difference from the reference aborts.
+ */
+int LLVMFuzzerTestOneInput(const uint8_t *data, size_t size)
+{
+    if (size < 4)
+        return 0;
+    RenderOptions options;
+    memset(&options, 0, sizeof(options));
+    options.terminalWidth = 1 + data[0] % 120;
+    options.wrap = data[1] & 1;
+    options.balance = options.wrap && (data[1] & 2);
+    options.block = (data[1] >> 2) % 3;
+    options.align = (data[1] >> 4) % 3;
+    options.expandTabs = (data[1] >> 6) & 1;
+    options.tabSize = 1 + data[2] % 16;
+    options.offset = data[3] % 8;
+    if (verifyText((const char *)data + 4, size - 4, &options, (unsigned int)size) != 0)
+        abort();
+    return 0;
+}
+#else
+/**
+ * Fills a buffer with a random text: ASCII words, blank lines, tabs,
+ * control characters, escape sequences, wide and combining characters,
+ * and invalid or truncated UTF-8, now and then with a null byte or a line
+ * long enough for the stream to pass it through.
+ *
+ * @param longLine Start the text with a line of VERIFY_LONG_LINE bytes.
+ * @return Length of the text.
+ */
+static size_t generateVerifyText(char *buffer, unsigned int *seed, int longLine)
+{
+    static const char *const pieces[] = {
+        "a", "word", "lorem ipsum dolor sit amet", " ", "  ", "\t", "\n", "\n", "\n\n", "\n\n\n", "\r", "\x01",
+        "\x7f", "\033[1;31m", "\033[0m", "\033]8;;https://example.com\033\\", "\033", "\033[", "\xc3\xa9",
+        "e\xcc\x81", "\xe4\xb8\xad\xe6\x96\x87", "\xf0\x9f\x98\x80", "\xef\xbc\xa1", "\xff", "\xc3", "\xe4\xb8",
+        "\xed\xa0\x80", "\xf8\x88\x80\x80\x80", "\xe2\x80\x8b",
+    };
+    size_t count = sizeof(pieces) / sizeof(pieces[0]);
+    size_t length = 0;
+    if (longLine)
+    {
+        while (length < VERIFY_LONG_LINE)
+        {
+            // No newlines, and mostly ASCII so it is wide
+            const char *piece = verifyRandom(seed) % 8 ? "lorem ipsum " : pieces[13 + verifyRandom(seed) % 16];
+            size_t n = strlen(piece);
+            memcpy(buffer + length, piece, n);
+            length += n;
+        }
+        buffer[length++] = '\n';
+    }
+
+    // Now and then long enough to span several render blocks of RENDER_BLOCK_LINES
+    size_t limit = verifyRandom(seed) % 8 ? VERIFY_TEXT_SIZE / 16 : VERIFY_TEXT_SIZE;
+    size_t target = length + ((size_t)verifyRandom(seed) << 15 | verifyRandom(seed)) % limit;
+    while (length < target)
+    {
+        const char *piece = pieces[verifyRandom(seed) % count];
+        size_t n = strlen(piece);
+        memcpy(buffer + length, piece, n);
+        length += n;
+    }
+    if (verifyRandom(seed) % 16 == 0 && length > 0)
+        buffer[verifyRandom(seed) % length] = '\0'; // The text ends here
+    return length;
+}
+
+/**
+ * Verifies random texts in random layouts
+ *
+ * @param rounds Number of texts.
+ * @return Number of rounds with differences.
+ */
+static int verifyRandomTexts(long rounds)
+{
+    char *buffer = (char *)malloc(VERIFY_LONG_LINE + VERIFY_TEXT_SIZE + 64);
+    if (!buffer)
+    {
+        perror("Memory allocation error for verify text");
+        exit(1);
+    }
+    int failedRounds = 0;
+    for (long round = 0; round < rounds; round++)
+    {
+        unsigned int seed = (unsigned int)round + 1;
+        RenderOptions options;
+        memset(&options, 0, sizeof(options));
+        options.terminalWidth = 1 + verifyRandom(&seed) % 120;
+        options.tabSize = 1 + verifyRandom(&seed) % 16;
+        options.block = verifyRandom(&seed) % 3;
+        options.align = verifyRandom(&seed) % 3;
+        options.offset = verifyRandom(&seed) % 4 ? 0 : verifyRandom(&seed) % 16;
+        options.expandTabs = verifyRandom(&seed) % 2;
+        int longLine = verifyRandom(&seed) % 16 == 0;
+        if (!longLine) // Wrapping a megabyte line takes too long to be worth it
+        {
+            options.wrap = verifyRandom(&seed) % 2;
+            options.balance = options.wrap && verifyRandom(&seed) % 2;
+        }
+
+        size_t length = generateVerifyText(buffer, &seed, longLine);
+        if (verifyText(buffer, length, &options, seed) != 0)
+        {
+            fprintf(stderr,
+                    "verify: round %ld (%zu bytes, width %d, tab size %d, block %d, align %d, offset %d, "
+                    "wrap %d, balance %d, expand tabs %d)\n",
+                    round, length, options.terminalWidth, options.tabSize, options.block, options.align,
+                    options.offset, options.wrap, options.balance, options.expandTabs);
+            failedRounds++;
+        }
+    }
+    free(buffer);
+    return failedRounds;
+}
+
+/**
+ * Verifies a file in every block mode with and without (balanced)
+ * wrapping, and once each aligned left, aligned right and with tabs
+ * expanded.
+ *
+ * @return Number of layouts with differences, -1 if the file cannot be read.
+ */
+static int verifyFile(const char *filename)
+{
+    size_t mappedLength, length;
+    char *text = mapFileToString(filename, &mappedLength, &length);
+    if (!text)
+        return -1;
+    RenderOptions layouts[12];
+    memset(layouts, 0, sizeof(layouts));
+    for (int i = 0; i < 12; i++)
+    {
+        layouts[i].terminalWidth = FILE_WIDTH;
+        layouts[i].tabSize = DEFAULT_TAB_SIZE;
+        layouts[i].block = i % 3;
+        layouts[i].wrap = i / 3 % 4 >= 1;
+        layouts[i].balance = i / 3 % 4 == 2;
+    }
+    layouts[9].align = ALIGN_LEFT;
+    layouts[10].align = ALIGN_RIGHT;
+    layouts[11].expandTabs = 1;
+    int failed = 0;
+    for (int i = 0; i < 12; i++)
+    {
+        if (verifyText(text, length, &layouts[i], (unsigned int)i + 1) != 0)
+        {
+            fprintf(stderr, "verify: %s (block %d, align %d, wrap %d, balance %d, expand tabs %d)\n", filename,
+                    layouts[i].block, layouts[i].align, layouts[i].wrap, layouts[i].balance,
+                    layouts[i].expandTabs);
+            failed++;
+        }
+    }
+    freeFileContent(text, mappedLength);
+    return failed;
+}
+
+int main(int argc, char *argv[])
+{
+    useUtf8Locale();
+    char *end;
+    long rounds = argc > 1 ? strtol(argv[1], &end, 10) : DEFAULT_ROUNDS;
+    if (argc == 1 || (argc == 2 && *end == '\0'))
+    {
+        if (rounds < 1)
+        {
+            fprintf(stderr, "Usage: %s [rounds | FILE...]\n", argv[0]);
+            return 1;
+        }
+        return verifyRandomTexts(rounds) == 0 ? 0 : 1;
+    }
+    int failed = 0;
+    for (int i = 1; i < argc; i++)
+    {
+        failed |= verifyFile(argv[i]) != 0;
+    }
+    return failed;
+}
+#endif